@@ -4,21 +4,28 @@
 #include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
 #include <cmath>
 #include <cstdarg>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <future>
 #include <iterator>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <numeric>
+#include <optional>
 #include <queue>
 #include <random>
 #include <set>
 #include <string>
 #include <thread>
 #include <type_traits>
+#include <typeinfo>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -28,9 +35,15 @@
 #include <parlay/primitives.h>
 #include <parlay/random.h>
 #include <spdlog/spdlog.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "../utils/beamSearch.h"
 #include "debug.hpp"
+#include "huge_page.hpp"
+#include "rcu.hpp"
 // #include "dist.hpp"
 #define DEBUG_OUTPUT 0
 #if DEBUG_OUTPUT
@@ -48,40 +61,114 @@ using namespace parlayANN;
 
 enum class type_metric { L2, ANGULAR, DOT };
 
+// vectors embedded in a version 4 model: none, as they are, or scalar-quantized
+// to 8 bits per dimension (decoded when loading)
+enum class type_payload : uint32_t { NONE, RAW, SQ8 };
+
+// selects the constructor that imports an index saved by hnswlib
+struct from_hnswlib_t {};
+inline constexpr from_hnswlib_t from_hnswlib{};
+
 struct point {
     float x, y;
 };
 
+// The ids of the nodes and of the points: the descriptor's type_id, which is
+// 32 bits unless an index has to hold more than 4G points
+template <class U, class = void>
+struct id_of {
+    using type = uint32_t;
+};
+
+template <class U>
+struct id_of<U, std::void_t<typename U::type_id>> {
+    using type = typename U::type_id;
+};
+
 template <typename U, template <typename> class Allocator = std::allocator>
 class HNSW {
     // using T = typename U::type_point;
     using T = typename U::type_point;
-    typedef uint32_t node_id;
 
 public:
+    typedef typename id_of<U>::type node_id;
 
     template <typename Iter>
     HNSW(Iter begin, Iter end, uint32_t dim, float m_l = 16, uint32_t m = 16,
-         uint32_t ef_construction = 50, float alpha = 5, float batch_base = 2);
+         uint32_t ef_construction = 50, float alpha = 5, float batch_base = 2,
+         const build_control &ctrl = {});
 
     template <typename G>
     HNSW(const std::string &filename_model, G getter);
 
-    parlay::sequence<std::pair<uint32_t, float>> search(
+    // load a model that embeds its vectors
+    explicit HNSW(const std::string &filename_model)
+        : HNSW(filename_model, nullptr) {}
+
+    // serve a version 4 model that is already in memory, e.g., a copy placed
+    // on a NUMA node; `region` holds the whole file and is kept alive
+    template <typename G>
+    HNSW(std::shared_ptr<void> region, size_t size, G getter) {
+        attach_v4(std::move(region), size, getter);
+    }
+
+    // load a base model and replay the delta log on top of it
+    template <typename G>
+    HNSW(const std::string &filename_model, const std::string &filename_log,
+         G getter)
+        : HNSW(filename_model, getter) {
+        replay_log(filename_log, getter);
+    }
+
+    // the adjacency is owned by the index and freed with it; a moved-from
+    // index is left without nodes
+    HNSW(const HNSW &) = delete;
+    HNSW &operator=(const HNSW &) = delete;
+    HNSW(HNSW &&other) noexcept;
+    HNSW &operator=(HNSW &&other) noexcept;
+    ~HNSW();
+
+    parlay::sequence<std::pair<node_id, float>> search(
                 const T &q, uint32_t k, uint32_t ef, const search_control &ctrl = {});
 
-    parlay::sequence<std::pair<uint32_t, float>> search_exact(
+    parlay::sequence<std::pair<node_id, float>> search_exact(
                 const T &q, uint32_t k);
 
-    void save(const std::string &filename_model) const;
+    // Fault in (and optionally lock) what the queries touch, then replay the
+    // sample queries, so that the first real ones do not pay for page faults
+    template <class Seq = parlay::sequence<T>>
+    warmup_report warm_up(const warmup_control &ctrl = {}, const Seq &queries = {});
+
+    // Bytes held by the index: the nodes, the adjacency and what is mapped or
+    // decoded for it, but not the vectors that the getter points into
+    size_t memory_footprint() const;
+
+    // version 3 is written field by field, while version 4 has page-aligned
+    // flat arrays that the loader maps and serves the searches from. Version
+    // 3 keeps 32-bit ids, which are widened when loaded by a 64-bit index;
+    // version 4 stores the ids as they are and only loads with the same width
+    void save(const std::string &filename_model, uint32_t version = 3,
+              type_payload payload = type_payload::NONE) const;
+
+    // Convert from and to the binary layout of hnswlib's saveIndex(): the
+    // internal ids are the nodes and the labels are the ids of the points.
+    // A null getter takes the vectors stored in its level-0 block
+    template <typename G>
+    HNSW(from_hnswlib_t, const std::string &filename_index, G getter);
+
+    void save_hnswlib(const std::string &filename_index) const;
 
 public:
     typedef uint32_t type_index;
 
+    // the adjacency list of a node on a level, replaced as a whole so that
+    // searches can run alongside insert()
+    using nbh_list = rcu_list<node_id>;
+
     struct node {
         // uint32_t id;
         uint32_t level;
-        parlay::sequence<node_id> *neighbors;
+        nbh_list *neighbors;
         T data;
     };
 
@@ -89,12 +176,13 @@ public:
         float d;
         node_id u;
 
+        // ties are broken by the ids to make the order deterministic
         constexpr bool operator<(const dist &rhs) const {
-            return d < rhs.d;
+            return d < rhs.d || (d == rhs.d && u < rhs.u);
         }
 
         constexpr bool operator>(const dist &rhs) const {
-            return d > rhs.d;
+            return rhs < *this;
         }
     };
 
@@ -104,17 +192,17 @@ public:
 
     struct nearest {
         constexpr bool operator()(const dist &lhs, const dist &rhs) const {
-            return lhs.d > rhs.d;
+            return lhs > rhs;
         }
     };
 
     struct farthest {
         constexpr bool operator()(const dist &lhs, const dist &rhs) const {
-            return lhs.d < rhs.d;
+            return lhs < rhs;
         }
     };
 
-    parlay::sequence<node_id> entrance;  // To init
+    nbh_list entrance;  // To init
     // auto m, max_m0, m_L; // To init
     uint32_t dim;
     float m_l;
@@ -122,9 +210,12 @@ public:
     // uint32_t level_max = 30; // To init
     uint32_t ef_construction;
     float alpha;
-    uint32_t n;
+    std::atomic<node_id> n{0};  // read by searches while insert() grows it
+    build_control ctrl_build;
+    parlay::sequence<uint32_t> ef_layer;  // current ef_construction per layer
     Allocator<node> allocator;
-    parlay::sequence<node> node_pool;
+    // searches index it while insert() appends to it
+    rcu_array<node> node_pool;
     mutable parlay::sequence<size_t> total_visited =
         parlay::sequence<size_t>(parlay::num_workers());
     mutable parlay::sequence<size_t> total_eval =
@@ -134,19 +225,190 @@ public:
     mutable parlay::sequence<size_t> total_range_candidate =
         parlay::sequence<size_t>(parlay::num_workers());
 
-    static auto neighbourhood(node &u, uint32_t level)
-    -> parlay::sequence<node_id> & {
+    // the lists of a node on levels 0 to `level`, in index memory
+    static nbh_list *new_neighbors(uint32_t level) {
+        auto *p = static_cast<nbh_list *>(
+                      huge_page_pool::global().allocate((level + 1) * sizeof(nbh_list)));
+        std::uninitialized_default_construct_n(p, level + 1);
+        return p;
+    }
+
+    static auto neighbourhood(node &u, uint32_t level) -> nbh_list & {
         // const constexpr auto level_none = std::numeric_limits<uint32_t>::max();
         // return level==level_none? u.final_nbh: u.neighbors[level];
         // return level==0? u.final_nbh: u.neighbors[level];
         return u.neighbors[level];
     }
 
-    static auto neighbourhood(const node &u, uint32_t level)
-    -> const parlay::sequence<node_id> & {
+    static auto neighbourhood(const node &u, uint32_t level) -> const nbh_list & {
         return neighbourhood(const_cast<node &>(u), level);
     }
 
+    // Read-only adjacency of both the owned and the mapped (version 4) models
+    using nbh_view = parlay::slice<const node_id *, const node_id *>;
+
+    nbh_view neighbourhood_view(node_id pu, uint32_t level) const {
+        if (mapped.adj) {
+            const uint64_t *offset = &mapped.offset_adj[mapped.offset_level[pu] + level];
+            return parlay::make_slice(mapped.adj + offset[0], mapped.adj + offset[1]);
+        }
+        return neighbourhood(get_node(pu), level).view();
+    }
+
+    struct header_v4 {
+        char model_type[4];
+        uint32_t version;
+        size_t code_U;
+        size_t size_node;
+        uint32_t dim;
+        float m_l;
+        uint32_t m;
+        uint32_t ef_construction;
+        float alpha;
+        uint32_t n;
+        uint64_t cnt_list;  // number of adjacency lists, i.e., sum of (level+1)
+        uint64_t cnt_edge;
+        uint64_t size_entrance;
+        // byte offsets of the sections, each aligned to `align_v4`
+        uint64_t off_level;         // uint32_t[n]
+        uint64_t off_id;            // node_id[n]
+        uint64_t off_offset_level;  // uint64_t[n+1], first list of each node
+        uint64_t off_offset_adj;    // uint64_t[cnt_list+1], first edge of each list
+        uint64_t off_adj;           // node_id[cnt_edge]
+        uint64_t off_entrance;      // node_id[size_entrance]
+        uint64_t size_file;
+        // the fields below were appended later and read as zero in older files
+        type_payload payload;
+        uint32_t size_elem;
+        uint64_t stride_vector;    // bytes per vector, a multiple of 64 if RAW
+        uint64_t off_vector;       // n vectors in the order of the nodes
+        uint64_t off_quant_param;  // SQ8 only: float min[dim], float scale[dim]
+        uint32_t size_id;          // bytes per node or point id; 4 if zero
+        uint64_t cnt_node;         // n in full, as `n` above has 32 bits
+    };
+    static constexpr uint64_t align_v4 = 4096;
+
+    struct mapped_model {
+        std::shared_ptr<void> region;  // unmaps the file when released
+        std::shared_ptr<void> vector;  // the decoded vectors of a SQ8 payload
+        const uint64_t *offset_level = nullptr;
+        const uint64_t *offset_adj = nullptr;
+        const node_id *adj = nullptr;
+        // with embedded vectors the levels and the points are read from the
+        // mapping too and the node pool stays empty, so the processes that
+        // map the same file share all of the model through the page cache
+        const uint32_t *level = nullptr;
+        const node_id *id = nullptr;
+        const typename U::type_elem *vec = nullptr;
+        size_t stride = 0;  // in elements
+        size_t size_region = 0;  // in bytes, of `region` and `vector`
+        size_t size_vector = 0;
+        // the regions and vectors of the indexes merged into this one, which
+        // the points taken from them refer to
+        std::vector<std::shared_ptr<void>> merged;
+    } mapped;
+
+    template <typename G>
+    void load_v4(const std::string &filename_model, G getter);
+
+    template <typename G>
+    void attach_v4(std::shared_ptr<void> region, size_t size, G getter);
+
+    void save_v4(const std::string &filename_model, type_payload payload) const;
+
+    // magic, version, code_U, size_node, dim, m_l, m, ef_construction, alpha, n
+    static constexpr size_t size_header_v3 = 4 + 4 + 8 + 8 + 4 * 6;
+
+    // offsetLevel0, max_elements, cur_element_count, size_data_per_element,
+    // label_offset, offsetData, maxlevel, enterpoint_node, maxM, maxM0, M,
+    // mult, ef_construction
+    static constexpr size_t size_header_hnswlib = 8 * 6 + 4 + 4 + 8 * 3 + 8 + 8;
+
+    // pread/pwrite the range in chunks from all workers
+    static void read_parallel(int fd, char *buf, size_t size, size_t off);
+    static void write_parallel(int fd, const char *buf, size_t size, size_t off);
+
+    // copy the mapped adjacency into the nodes before modifying the graph
+    void thaw();
+
+    // Version 3 and hnswlib only have room for 32-bit ids
+    bool fits_32bit() const {
+        if constexpr (sizeof(node_id) == sizeof(uint32_t)) return true;
+        else {
+            constexpr node_id id_max = std::numeric_limits<uint32_t>::max();
+            if (n > id_max) return false;
+            return !parlay::any_of(parlay::iota<node_id>(n), [&](node_id pu) {
+                return node_id(U::get_id(point_of(pu))) > id_max;
+            });
+        }
+    }
+
+    static void write_id32(char *p, const node_id *ids, size_t size) {
+        if constexpr (sizeof(node_id) == sizeof(uint32_t))
+            memcpy(p, ids, size * sizeof(node_id));
+        else for (size_t i = 0; i < size; ++i) {
+            const uint32_t id = ids[i];
+            memcpy(p + i * sizeof(id), &id, sizeof(id));
+        }
+    }
+
+    // Append-only log of the nodes, adjacency lists and entrances changed by
+    // each insert() on top of a base model
+    struct delta_log {
+        std::string filename_base;
+        std::string filename_log;
+        uint32_t version_base;
+        bool sync;
+        int fd = -1;
+        // the end of the log, where the next record is written; the records
+        // are written in parallel chunks, so the fd is not in O_APPEND mode
+        uint64_t size = 0;
+        std::mutex mutex;  // the appends against the file swap of compaction
+
+        ~delta_log() {
+            if (fd != -1) close(fd);
+        }
+    };
+    std::shared_ptr<delta_log> log_delta;
+    // the records of the second version have 64-bit ids
+    static constexpr char magic_log[8] = {'H', 'N', 'S', 'W', 'L', 'O', 'G',
+                                          sizeof(node_id) == 4 ? '1' : '2'
+                                         };
+
+    // an adjacency list changed by an update: the node and the level
+    using list_ref = std::pair<node_id, uint32_t>;
+
+    void append_log(const node_id *node_new, uint32_t size_batch,
+                    parlay::sequence<list_ref> &&list_changed);
+
+    static void compact_log(delta_log &log);
+
+    static uint64_t checksum(const char *data, size_t size) {
+        auto h = parlay::delayed_seq<uint64_t>(size / 8, [&](size_t i) {
+            uint64_t w;
+            memcpy(&w, data + i * 8, 8);
+            return parlay::hash64(w ^ parlay::hash64(i));
+        });
+        return parlay::reduce(h);
+    }
+
+    // From now on, write the changes of every insert() to `filename_log`.
+    // The index must be the state of `filename_base` plus the records that
+    // are already in the log; a missing base is saved first
+    void attach_log(const std::string &filename_base,
+                    const std::string &filename_log, uint32_t version_base = 3,
+                    bool sync = true);
+
+    // Apply the records of the log (up to byte `size_limit`) that are newer
+    // than the index; returns the number of records applied
+    template <typename G>
+    size_t replay_log(const std::string &filename_log, G getter,
+                      size_t size_limit = std::numeric_limits<size_t>::max());
+
+    // Merge the log into a new base model in the background, restarting the
+    // log with the records appended meanwhile. Embedded vectors are not kept
+    std::future<void> compact() const;
+
     node &get_node(node_id id) {
         return node_pool[id];
     }
@@ -155,6 +417,48 @@ public:
         return node_pool[id];
     }
 
+    // The level and the point of a node, also when they are in the mapping;
+    // the searches and the writers read the nodes through these
+    uint32_t level_of(node_id pu) const {
+        return mapped.level ? mapped.level[pu] : node_pool[pu].level;
+    }
+
+    // Refers to the point of a node in the pool, or holds the one built over
+    // the mapped vector, so that an owned point is never copied to be read
+    class point_ref {
+    public:
+        explicit point_ref(const T &p) : p(&p) {}
+        explicit point_ref(T &&p) : built(std::move(p)), p(nullptr) {}
+
+        const T &get() const {
+            return p ? *p : *built;
+        }
+        operator const T &() const {
+            return get();
+        }
+        const T *operator->() const {
+            return &get();
+        }
+
+    private:
+        std::optional<T> built;
+        const T *p;
+    };
+
+    point_ref point_of(node_id pu) const {
+        if constexpr (std::is_constructible_v<T, node_id, const typename U::type_elem *>) {
+            if (mapped.level) return point_ref(T(mapped.id[pu], mapped.vec + pu * mapped.stride));
+        }
+        return point_ref(node_pool[pu].data);
+    }
+
+    // Resize the pool for new nodes. Storage that has to be moved is
+    // published anew and the old one retired rather than freed, as searches
+    // may still be reading the nodes in it
+    void grow_pool(size_t size) {
+        node_pool.resize(size);
+    }
+
     class dist_evaluator {
         using point_t = T;
         using dist_t = float;
@@ -173,22 +477,21 @@ public:
     };
 
     struct graph {
-        template <class Nbh>
         struct edgeRange {
-            edgeRange(Nbh &nbh) : nbh(nbh) {}
+            edgeRange(nbh_view nbh) : nbh(nbh) {}
             decltype(auto) operator[](node_id pu) const {
-                return nbh.get()[pu];
+                return nbh[pu];
             }
             auto size() const {
-                return nbh.get().size();
+                return nbh.size();
             }
             void prefetch() const {
                 int l = (size() * sizeof(node_id)) / 64;
                 for (int i = 0; i < l; i++)
-                    __builtin_prefetch((char *)nbh.get().data() + i * 64);
+                    __builtin_prefetch((const char *)nbh.begin() + i * 64);
             }
 
-            std::reference_wrapper<Nbh> nbh;
+            nbh_view nbh;
         };
 
         using nid_t = node_id;
@@ -201,20 +504,14 @@ public:
         decltype(auto) get_node(node_id pu) const {
             return hnsw.get().get_node(pu);
         }
-        decltype(auto) get_edges(node_id pu) {
-            return hnsw.get().neighbourhood(hnsw.get().get_node(pu), l);
-        }
-        decltype(auto) get_edges(node_id pu) const {
-            return hnsw.get().neighbourhood(hnsw.get().get_node(pu), l);
+        nbh_view get_edges(node_id pu) const {
+            return hnsw.get().neighbourhood_view(pu, l);
         }
 
         uint32_t max_degree() const {
             return hnsw.get().get_threshold_m(l);
         }
 
-        auto operator[](node_id pu) {
-            return edgeRange(get_edges(pu));
-        }
         auto operator[](node_id pu) const {
             return edgeRange(get_edges(pu));
         }
@@ -223,9 +520,42 @@ public:
         uint32_t l;
     };
 
+    struct batch_stat {
+        double time;         // wall time of the batch in seconds
+        double utilization;  // share of the workers' time spent on the nodes
+        float missed_rank;   // batch peers closer than the nearest new neighbor
+    };
+    parlay::sequence<std::pair<uint32_t, batch_stat>> batch_schedule;
+
     // node* insert(const T &q, uint32_t id);
     template <typename Iter>
-    void insert(Iter begin, Iter end, bool from_blank);
+    batch_stat insert(Iter begin, Iter end, bool from_blank);
+
+    // Append the nodes of `other` (with their ids shifted by n) and link the
+    // two graphs: every node is searched for with `ef` in the other graph on
+    // each level that both have, and its list there is pruned again from its
+    // old neighbors and the ones found. The ids of the points must differ.
+    // The points are copied as they are: the vectors that `other` serves from
+    // its mapping or an imported block are kept alive here, while the ones a
+    // point only refers to, e.g., from a getter, must outlive this index
+    void merge(const HNSW &other, uint32_t ef = 32);
+
+    float get_missed_rank(const node_id *node_new,
+                          const parlay::sequence<node_id> *nbh_new,
+                          uint32_t size_batch) const;
+
+    uint32_t next_batch_size(uint32_t size_batch, size_t size_graph,
+                             const batch_stat &stat, float batch_base,
+                             uint32_t size_limit) const;
+
+    template <class Edges>
+    void add_reverse_edges(Edges &&edges, uint32_t l_c);
+
+    template <class Seq>
+    void build_bulk(const Seq &seq);
+
+    auto get_knn_candidates(const parlay::sequence<node_id> &subset,
+                            uint32_t k) const;
 
     template <typename Queue>
     void select_neighbors_simple_impl(const T &u, Queue &C, uint32_t M) {
@@ -304,7 +634,7 @@ public:
             // auto &e = C_cp.top();
             W_tmp.insert(e.u);
             if (extendCandidate) {
-                for (node_id e_adj : neighbourhood(get_node(e.u), level)) {
+                for (node_id e_adj : neighbourhood(get_node(e.u), level).view()) {
                     // if(e_adj==nullptr) continue; // TODO: check
                     if (W_tmp.find(e_adj) == W_tmp.end()) W_tmp.insert(e_adj);
                 }
@@ -387,7 +717,8 @@ public:
 
     template <class Seq_, class D, class G,
               class Seq = std::remove_cv_t<std::remove_reference_t<Seq_>>>
-    Seq prune_heuristic(Seq_ &&cand, uint32_t size, D f_dist, G g) const {
+    Seq prune_heuristic(Seq_ &&cand, uint32_t size, D f_dist, G g,
+                        uint32_t *cnt_tail = nullptr) const {
         using nid_t = node_id;
         using conn = dist;
 
@@ -397,6 +728,7 @@ public:
 
         Seq res, pruned;
         std::unordered_set<nid_t> nbh;
+        size_t pos_last = 0;  // position past the last selected candidate
         for (conn &c : workset) {
             const auto d_cu = c.d * alpha;
 
@@ -411,10 +743,13 @@ public:
 
             if (!is_pruned) {
                 res.push_back(std::move(c));
+                pos_last = res.size() + pruned.size();
                 if (res.size() == size) break;
             } else
                 pruned.push_back(std::move(c));
         }
+        // the candidates behind the last selected one did not contribute
+        if (cnt_tail) *cnt_tail = workset.size() - pos_last;
         return res;
     }
 
@@ -422,7 +757,8 @@ public:
         const T &u,
         /*const std::priority_queue<dist,parlay::sequence<dist>,farthest> &C,*/
         const parlay::sequence<dist> &C, uint32_t M, uint32_t level,
-        bool extendCandidate = false, bool keepPrunedConnections = false) {
+        bool extendCandidate = false, bool keepPrunedConnections = false,
+        uint32_t *cnt_tail = nullptr) {
         /*
         (void)level, (void)extendCandidate, (void)keepPrunedConnections;
         return select_neighbors_simple(u,C,M);
@@ -432,7 +768,7 @@ public:
 
         dist_evaluator f_dist(u, dim);
         graph g(*this, level);
-        auto res = prune_heuristic(C, M, f_dist, g);
+        auto res = prune_heuristic(C, M, f_dist, g, cnt_tail);
         return parlay::tabulate(res.size(), [&](size_t i) {
             return res[i].u;
         });
@@ -451,6 +787,15 @@ public:
         return res;
     }
 
+    uint32_t get_level(node_id pu) {
+        if (!ctrl_build.seed) return get_level_random();
+        // hash the id with the seed into (0,1] so that the level does not
+        // depend on which worker happens to create the node
+        const uint64_t h = parlay::hash64(*ctrl_build.seed ^ parlay::hash64(pu));
+        const double r = ((h >> 11) + 1) * 0x1.0p-53;
+        return uint32_t(-log(r) * m_l);
+    }
+
     //search_layer(u, eps_u, 1, l);
     auto search_layer(const node &u, const parlay::sequence<node_id> &eps,
                       uint32_t ef, uint32_t l_c,
@@ -466,7 +811,7 @@ public:
     search_control ctrl = {}) const;
     parlay::sequence<node_id> search_layer_to(const node &u, uint32_t ef,
             uint32_t l_stop,
-            const search_control &ctrl = {});
+            const search_control &ctrl = {}) const;
 
     auto get_threshold_m(uint32_t level) const {
         return level == 0 ? m * 2 : m;
@@ -474,12 +819,20 @@ public:
         // return m;
     }
 
+    uint32_t get_ef_construction(uint32_t level) const {
+        if (ef_layer.empty()) return ef_construction;
+        return ef_layer[std::min<size_t>(level, ef_layer.size() - 1)];
+    }
+
+    void adapt_ef_construction(uint32_t level, size_t cnt_cand, size_t cnt_tail);
+
 public:
     auto get_deg(uint32_t level = 0) {
         parlay::sequence<uint32_t> res;
-        res.reserve(node_pool.size());
-        for (const node &e : node_pool) {
-            if (e.level >= level) res.push_back(e.neighbors[level].size());
+        res.reserve(n);
+        for (node_id pu = 0; pu < n; ++pu) {
+            if (level_of(pu) >= level)
+                res.push_back(neighbourhood_view(pu, level).size());
         }
         return res;
     }
@@ -489,24 +842,24 @@ public:
         auto *&res = indeg[level];
         if (!res) {
             res = new uint32_t[n];
-            for (uint32_t i = 0; i < n; ++i) res[i] = 0;
-            for (const node_id pu : node_pool) {
-                if (get_node(pu).level < level) continue;
-                for (const node_id pv : get_node(pu).neighbors[level])
-                    res[U::get_id(get_node(pv).data)]++;
+            for (node_id i = 0; i < n; ++i) res[i] = 0;
+            for (node_id pu = 0; pu < n; ++pu) {
+                if (level_of(pu) < level) continue;
+                for (const node_id pv : neighbourhood_view(pu, level))
+                    res[U::get_id(point_of(pv))]++;
             }
         }
         return res;
     }
 
     uint32_t get_height() const {
-        return get_node(entrance[0]).level;
+        return level_of(entrance[0]);
     }
 
     size_t cnt_degree(uint32_t l) const {
         auto cnt_each = parlay::delayed_seq<size_t>(n, [&](size_t i) {
             node_id pu = i;
-            return get_node(pu).level < l ? 0 : neighbourhood(get_node(pu), l).size();
+            return level_of(pu) < l ? 0 : neighbourhood_view(pu, l).size();
         });
         return parlay::reduce(cnt_each, parlay::addm<size_t>());
     }
@@ -514,7 +867,7 @@ public:
     size_t cnt_vertex(uint32_t l) const {
         auto cnt_each = parlay::delayed_seq<size_t>(n, [&](size_t i) {
             node_id pu = i;
-            return get_node(pu).level < l ? 0 : 1;
+            return level_of(pu) < l ? 0 : 1;
         });
         return parlay::reduce(cnt_each, parlay::addm<size_t>());
     }
@@ -522,50 +875,84 @@ public:
     size_t get_degree_max(uint32_t l) const {
         auto cnt_each = parlay::delayed_seq<size_t>(n, [&](size_t i) {
             node_id pu = i;
-            return get_node(pu).level < l ? 0 : neighbourhood(get_node(pu), l).size();
+            return level_of(pu) < l ? 0 : neighbourhood_view(pu, l).size();
         });
         return parlay::reduce(cnt_each, parlay::maxm<size_t>());
     }
 };
 
+template <typename U, template <typename> class Allocator>
+HNSW<U, Allocator>::HNSW(HNSW &&other) noexcept
+    : entrance(std::move(other.entrance)), dim(other.dim), m_l(other.m_l),
+      m(other.m), ef_construction(other.ef_construction), alpha(other.alpha),
+      n(other.n.load()), ctrl_build(std::move(other.ctrl_build)),
+      ef_layer(std::move(other.ef_layer)), allocator(std::move(other.allocator)),
+      node_pool(std::move(other.node_pool)),
+      total_visited(std::move(other.total_visited)),
+      total_eval(std::move(other.total_eval)),
+      total_size_C(std::move(other.total_size_C)),
+      total_range_candidate(std::move(other.total_range_candidate)),
+      mapped(std::move(other.mapped)), log_delta(std::move(other.log_delta)),
+      batch_schedule(std::move(other.batch_schedule)) {
+    // the lists belong to this index now
+    other.node_pool.clear();
+    other.mapped = {};
+    other.n = 0;
+}
+
+template <typename U, template <typename> class Allocator>
+auto HNSW<U, Allocator>::operator=(HNSW &&other) noexcept -> HNSW & {
+    if (this != &other) {
+        this->~HNSW();
+        new (this) HNSW(std::move(other));
+    }
+    return *this;
+}
+
+template <typename U, template <typename> class Allocator>
+HNSW<U, Allocator>::~HNSW() {
+    // no search is left, so the lists are freed rather than retired; the
+    // nodes in the retired pools share them and do not free them
+    parlay::parallel_for(0, node_pool.size(), [&](size_t i) {
+        node &u = node_pool[i];
+        if (!u.neighbors) return;
+        std::destroy_n(u.neighbors, u.level + 1);
+        huge_page_pool::deallocate(u.neighbors);
+        u.neighbors = nullptr;
+    });
+}
+
 template <typename U, template <typename> class Allocator>
 template <typename G>
 HNSW<U, Allocator>::HNSW(const std::string &filename_model, G getter) {
-    std::ifstream model(filename_model, std::ios::binary);
-    if (!model.is_open()) throw std::runtime_error("Failed to open the model");
-
-    const auto size_buffer = 1024 * 1024 * 1024;  // 1G
-    auto buffer = std::make_unique<char[]>(size_buffer);
-    model.rdbuf()->pubsetbuf(buffer.get(), size_buffer);
-
-    auto read = [&](auto &data, auto... args) {
-        auto read_impl = [&](auto &f, auto &data, auto... args) {
-            using T = std::remove_reference_t<decltype(data)>;
-            if constexpr (std::is_pointer_v<std::decay_t<T>>) {
-                auto read_array = [&](auto &data, size_t size, auto... args) {
-                    for (size_t i = 0; i < size; ++i) f(f, data[i], args...);
-                };
-                // use the array extent as the size
-                if constexpr (sizeof...(args) == 0 && std::is_array_v<T>) {
-                    read_array(data, std::extent_v<T>);
-                } else {
-                    static_assert(sizeof...(args), "size was not provided");
-                    read_array(data, args...);
-                }
-            } else {
-                static_assert(std::is_standard_layout_v<T>);
-                model.read((char *)&data, sizeof(data));
-            }
-        };
-        read_impl(read_impl, data, args...);
+    const int fd = open(filename_model.c_str(), O_RDONLY);
+    if (fd == -1) throw std::runtime_error("Failed to open the model");
+    std::unique_ptr<int, void (*)(int *)> guard_fd(new int(fd), [](int *fd) {
+        close(*fd);
+        delete fd;
+    });
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) throw std::runtime_error("Failed to open the model");
+    const size_t size_file = sb.st_size;
+
+    char header[size_header_v3] = {};
+    if (size_file < sizeof(header)) throw std::runtime_error("Truncated model");
+    read_parallel(fd, header, sizeof(header), 0);
+    const char *pos = header;
+    auto read = [&](auto &data) {
+        memcpy(&data, pos, sizeof(data));
+        pos += sizeof(data);
     };
 
-    char model_type[5] = {'\000'};
-    read(model_type, 4);
-    if (strcmp(model_type, "HNSW"))
+    if (memcmp(header, "HNSW", 4))
         throw std::runtime_error("Wrong type of model");
+    pos += 4;
     uint32_t version;
     read(version);
+    if (version == 4) {  // mapped rather than read
+        load_v4(filename_model, getter);
+        return;
+    }
     if (version != 3) throw std::runtime_error("Unsupported version");
 
     size_t code_U, size_node;
@@ -578,62 +965,468 @@ HNSW<U, Allocator>::HNSW(const std::string &filename_model, G getter) {
     read(m);
     read(ef_construction);
     read(alpha);
-    read(n);
-    puts("Configuration loaded");
-    printf("dim = %u\n", dim);
-    printf("m_l = %f\n", m_l);
-    printf("m = %u\n", m);
-    printf("efc = %u\n", ef_construction);
-    printf("alpha = %f\n", alpha);
-    printf("n = %u\n", n);
-    // read indices
-    // std::unordered_map<uint32_t,node*> addr;
-    node_pool.resize(n);
-    for (uint32_t i = 0; i < n; ++i) {
-        // auto *u = new node;
+    uint32_t cnt_node;
+    read(cnt_node);
+    n = cnt_node;
+    spdlog::info("Loaded model: n={} dim={} m_l={} m={} efc={} alpha={}", cnt_node, dim,
+                 m_l, m, ef_construction, alpha);
+
+    // read indices, i.e., (level, id) of each node; the ids in a version 3
+    // model are all 32 bits
+    const size_t off_index = sizeof(header);
+    const size_t off_adj = off_index + size_t(n) * 2 * sizeof(uint32_t);
+    if (size_file < off_adj) throw std::runtime_error("Truncated model");
+    auto index = parlay::sequence<uint32_t>::uninitialized(size_t(n) * 2);
+    read_parallel(fd, (char *)index.data(), off_adj - off_index, off_index);
+    if constexpr (std::is_null_pointer_v<G>)
+        throw std::runtime_error("The model has no embedded vectors");
+    // the getter is called concurrently
+    else node_pool.assign(n, [&](size_t i) {
+        const uint32_t level_u = index[i * 2];
+        return node{level_u, new_neighbors(level_u),
+                    getter(index[i * 2 + 1])};
+    });
+    index.clear();
+
+    // read the adjacency lists and the entrances in one go
+    const size_t size_adj = size_file - off_adj;
+    auto buffer = parlay::sequence<char>::uninitialized(size_adj);
+    read_parallel(fd, buffer.data(), size_adj, off_adj);
+    auto read_at = [&](size_t off, auto &data) {
+        if (off + sizeof(data) > size_adj) throw std::runtime_error("Truncated model");
+        memcpy(&data, &buffer[off], sizeof(data));
+    };
+    // every list is prefixed with its size, so the offsets are found by
+    // hopping over the lists; it only touches one word per list
+    parlay::sequence<size_t> offset_nbh(n);
+    size_t off = 0;
+    for (node_id i = 0; i < n; ++i) {
+        offset_nbh[i] = off;
+        for (uint32_t l = 0; l <= get_node(i).level; ++l) {
+            size_t size;
+            read_at(off, size);
+            off += sizeof(size) + size * sizeof(uint32_t);
+        }
+    }
+    if (off > size_adj) throw std::runtime_error("Truncated model");
+    parlay::parallel_for(0, n, [&](size_t i) {
         node &u = get_node(i);
-        read(u.level);
-        uint32_t id_u;  // TODO: use generic type
-        read(id_u);
-        u.data = getter(id_u);
-        // addr[id_u] = u;
-    }
-    for (node &u : node_pool) {
-        u.neighbors = new parlay::sequence<node_id>[u.level + 1];
+        const char *p = &buffer[offset_nbh[i]];
         for (uint32_t l = 0; l <= u.level; ++l) {
             size_t size;
-            read(size);
-            auto &nbh_u = u.neighbors[l];
-            nbh_u.reserve(size);
-            for (size_t i = 0; i < size; ++i) {
-                uint32_t id_v;
-                read(id_v);
-                nbh_u.push_back(id_v);
-            }
+            memcpy(&size, p, sizeof(size));
+            p += sizeof(size);
+            const auto *nbh = reinterpret_cast<const uint32_t *>(p);
+            neighbourhood(u, l).publish(nbh, nbh + size);
+            p += size * sizeof(uint32_t);
         }
-    }
+    });
     // read entrances
     size_t size;
-    read(size);
-    entrance.reserve(size);
-    for (size_t i = 0; i < size; ++i) {
-        uint32_t id_u;
-        read(id_u);
-        entrance.push_back(id_u);
+    read_at(off, size);
+    off += sizeof(size);
+    if (off + size * sizeof(uint32_t) > size_adj)
+        throw std::runtime_error("Truncated model");
+    const auto *ep = reinterpret_cast<const uint32_t *>(&buffer[off]);
+    entrance.publish(ep, ep + size);
+}
+
+template <typename U, template <typename> class Allocator>
+template <typename G>
+void HNSW<U, Allocator>::load_v4(const std::string &filename_model, G getter) {
+    const int fd = open(filename_model.c_str(), O_RDONLY);
+    if (fd == -1) throw std::runtime_error("Failed to open the model");
+    struct stat sb;
+    if (fstat(fd, &sb) == -1 || size_t(sb.st_size) < sizeof(header_v4)) {
+        close(fd);
+        throw std::runtime_error("Truncated model");
+    }
+    const size_t size_file = sb.st_size;
+    // the page cache behind a mapping has no huge pages, so the model is read
+    // into index memory instead
+    if (huge_page_pool::global().mode() != huge_page_mode::NONE) {
+        std::shared_ptr<void> region(huge_page_pool::global().allocate(size_file),
+                                     huge_page_pool::deallocate);
+        try {
+            read_parallel(fd, static_cast<char *>(region.get()), size_file, 0);
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+        return attach_v4(std::move(region), size_file, getter);
+    }
+    void *p = mmap(nullptr, size_file, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) throw std::runtime_error("Failed to map the model");
+    attach_v4(std::shared_ptr<void>(p, [size_file](void *p) {
+        munmap(p, size_file);
+    }), size_file, getter);
+}
+
+template <typename U, template <typename> class Allocator>
+template <typename G>
+void HNSW<U, Allocator>::attach_v4(std::shared_ptr<void> region, size_t size_file,
+                                   G getter) {
+    if (size_file < sizeof(header_v4)) throw std::runtime_error("Truncated model");
+    mapped.region = std::move(region);
+    mapped.size_region = size_file;
+
+    const char *base = static_cast<const char *>(mapped.region.get());
+    header_v4 header;
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.model_type, "HNSW", 4))
+        throw std::runtime_error("Wrong type of model");
+    if (header.version != 4) throw std::runtime_error("Unsupported version");
+    if (header.size_file != size_file)
+        throw std::runtime_error("Truncated model");
+    // the mapped ids are served as they are
+    if ((header.size_id ? header.size_id : sizeof(uint32_t)) != sizeof(node_id))
+        throw std::runtime_error("The model has ids of a different width");
+    // every section is dereferenced in place, so it has to lie in the file
+    const uint64_t cnt_node = header.size_id ? header.cnt_node : header.n;
+    auto fits = [&](uint64_t off, uint64_t cnt, uint64_t size_elem) {
+        return off <= size_file && cnt <= (size_file - off) / size_elem;
+    };
+    if (cnt_node == std::numeric_limits<uint64_t>::max() ||
+            header.cnt_list == std::numeric_limits<uint64_t>::max() ||
+            !fits(header.off_level, cnt_node, sizeof(uint32_t)) ||
+            !fits(header.off_id, cnt_node, sizeof(node_id)) ||
+            !fits(header.off_offset_level, cnt_node + 1, sizeof(uint64_t)) ||
+            !fits(header.off_offset_adj, header.cnt_list + 1, sizeof(uint64_t)) ||
+            !fits(header.off_adj, header.cnt_edge, sizeof(node_id)) ||
+            !fits(header.off_entrance, header.size_entrance, sizeof(node_id)))
+        throw std::runtime_error("Truncated model");
+    if (header.payload != type_payload::NONE &&
+            (header.stride_vector < uint64_t(header.dim) *
+             (header.payload == type_payload::RAW ? header.size_elem : 1) ||
+             !fits(header.off_vector, cnt_node, std::max<uint64_t>(header.stride_vector, 1)) ||
+             (header.payload == type_payload::SQ8 &&
+              !fits(header.off_quant_param, 2 * uint64_t(header.dim), sizeof(float)))))
+        throw std::runtime_error("Truncated model");
+    if (header.size_node != sizeof(node))
+        spdlog::warn("The model was saved with a different node layout");
+    // a model of another descriptor or metric would map fine and return the
+    // wrong distances
+    if (header.code_U != (typeid(U).hash_code() ^ sizeof(U)))
+        throw std::runtime_error("The model was saved with a different descriptor");
+
+    dim = header.dim;
+    m_l = header.m_l;
+    m = header.m;
+    ef_construction = header.ef_construction;
+    alpha = header.alpha;
+    n = cnt_node;
+    spdlog::info("Mapped model: n={} dim={} m={} efc={} edges={}", n, dim, m,
+                 ef_construction, header.cnt_edge);
+
+    const auto *level = reinterpret_cast<const uint32_t *>(base + header.off_level);
+    const auto *id = reinterpret_cast<const node_id *>(base + header.off_id);
+    mapped.offset_level =
+        reinterpret_cast<const uint64_t *>(base + header.off_offset_level);
+    mapped.offset_adj =
+        reinterpret_cast<const uint64_t *>(base + header.off_offset_adj);
+    mapped.adj = reinterpret_cast<const node_id *>(base + header.off_adj);
+    const auto *ep = reinterpret_cast<const node_id *>(base + header.off_entrance);
+
+    // the searches follow the offsets and the edges unchecked, so they have
+    // to stay in the sections: every node has level+1 lists, the lists are
+    // in order, and the edges and the entrances lead to nodes of their level
+    const uint64_t *offset_level = mapped.offset_level;
+    const uint64_t *offset_adj = mapped.offset_adj;
+    const bool bad_level = offset_level[0] != 0 ||
+                           offset_level[cnt_node] != header.cnt_list ||
+    parlay::any_of(parlay::iota<size_t>(cnt_node), [&](size_t i) {
+        return offset_level[i + 1] - offset_level[i] != uint64_t(level[i]) + 1;
+    });
+    if (bad_level) throw std::runtime_error("Corrupt model");
+    const bool bad_adj = offset_adj[header.cnt_list] != header.cnt_edge ||
+    parlay::any_of(parlay::iota<size_t>(header.cnt_list), [&](size_t i) {
+        return offset_adj[i] > offset_adj[i + 1];
+    });
+    if (bad_adj) throw std::runtime_error("Corrupt model");
+    const bool bad_edge = parlay::any_of(parlay::iota<size_t>(cnt_node), [&](size_t i) {
+        for (uint32_t l = 0; l <= level[i]; ++l) {
+            const uint64_t *offset = &offset_adj[offset_level[i] + l];
+            for (uint64_t e = offset[0]; e < offset[1]; ++e) {
+                if (mapped.adj[e] >= cnt_node || level[mapped.adj[e]] < l) return true;
+            }
+        }
+        return false;
+    });
+    const bool bad_entrance = (cnt_node && header.size_entrance == 0) ||
+    std::any_of(ep, ep + header.size_entrance, [&](node_id pe) {
+        return pe >= cnt_node;
+    });
+    if (bad_edge || bad_entrance) throw std::runtime_error("Corrupt model");
+
+    // the adjacency stays in the mapping; the nodes are only set for a getter
+    if constexpr (std::is_null_pointer_v<G>) {
+        using type_elem = typename U::type_elem;
+        static_assert(std::is_constructible_v<T, node_id, const type_elem *>);
+        if (header.payload == type_payload::NONE)
+            throw std::runtime_error("The model has no embedded vectors");
+        if (header.size_elem != sizeof(type_elem))
+            throw std::runtime_error("Embedded vectors are of a different type");
+
+        size_t stride;  // in elements
+        const type_elem *vec;
+        if (header.payload == type_payload::RAW) {
+            stride = header.stride_vector / sizeof(type_elem);
+            vec = reinterpret_cast<const type_elem *>(base + header.off_vector);
+        } else if constexpr (std::is_floating_point_v<type_elem>) {
+            stride = (dim * sizeof(type_elem) + 63) / 64 * 64 / sizeof(type_elem);
+            const auto *code = reinterpret_cast<const uint8_t *>(base + header.off_vector);
+            const auto *param =
+                reinterpret_cast<const float *>(base + header.off_quant_param);
+            auto *decoded = static_cast<type_elem *>(
+                                huge_page_pool::global().allocate(
+                                    size_t(n) * stride * sizeof(type_elem) + 64));
+            mapped.vector = std::shared_ptr<void>(decoded, huge_page_pool::deallocate);
+            mapped.size_vector = size_t(n) * stride * sizeof(type_elem) + 64;
+            parlay::parallel_for(0, n, [&](size_t i) {
+                for (uint32_t j = 0; j < dim; ++j) {
+                    decoded[i * stride + j] =
+                        param[j] + param[dim + j] * code[i * header.stride_vector + j];
+                }
+            });
+            vec = decoded;
+        } else {
+            throw std::runtime_error("SQ8 payload needs floating-point vectors");
+        }
+        mapped.level = level;
+        mapped.id = id;
+        mapped.vec = vec;
+        mapped.stride = stride;
+    } else {
+        node_pool.assign(n, [&](size_t i) {
+            return node{level[i], nullptr, getter(id[i])};
+        });
+    }
+    entrance.publish(ep, ep + header.size_entrance);
+}
+
+template <typename U, template <typename> class Allocator>
+template <typename G>
+HNSW<U, Allocator>::HNSW(from_hnswlib_t, const std::string &filename_index,
+                         G getter) {
+    using type_elem = typename U::type_elem;
+    const int fd = open(filename_index.c_str(), O_RDONLY);
+    if (fd == -1) throw std::runtime_error("Failed to open the hnswlib index");
+    std::unique_ptr<int, void (*)(int *)> guard_fd(new int(fd), [](int *fd) {
+        close(*fd);
+        delete fd;
+    });
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) throw std::runtime_error("Failed to open the hnswlib index");
+    const size_t size_file = sb.st_size;
+
+    char header[size_header_hnswlib];
+    if (size_file < sizeof(header)) throw std::runtime_error("Truncated hnswlib index");
+    read_parallel(fd, header, sizeof(header), 0);
+    const char *pos = header;
+    auto read = [&](auto &data) {
+        memcpy(&data, pos, sizeof(data));
+        pos += sizeof(data);
+    };
+    size_t offset_level0, max_elements, cnt_element, size_element, offset_label,
+           offset_data, max_m, max_m0, m_hnswlib, ef_hnswlib;
+    int32_t level_max;
+    uint32_t ep;
+    double mult;
+    read(offset_level0);
+    read(max_elements);
+    read(cnt_element);
+    read(size_element);
+    read(offset_label);
+    read(offset_data);
+    read(level_max);
+    read(ep);
+    read(max_m);
+    read(max_m0);
+    read(m_hnswlib);
+    read(mult);
+    read(ef_hnswlib);
+
+    const size_t size_data = offset_label - offset_data;
+    if (offset_level0 != 0 || offset_data != sizeof(uint32_t) * (max_m0 + 1) ||
+            size_element != offset_label + sizeof(size_t) ||
+            size_data == 0 || size_data % sizeof(type_elem))
+        throw std::runtime_error("Unrecognized hnswlib index");
+    // its internal ids, i.e., the nodes, have 32 bits
+    if (cnt_element > std::numeric_limits<uint32_t>::max() || cnt_element > max_elements)
+        throw std::runtime_error("Unsupported number of elements");
+    // hnswlib keeps the dimension in its space, not in the file
+    dim = size_data / sizeof(type_elem);
+    m_l = mult;
+    m = m_hnswlib;
+    ef_construction = ef_hnswlib;
+    alpha = 1;  // hnswlib's heuristic
+    n = cnt_element;
+    spdlog::info("hnswlib index: n = {}, dim = {}, M = {}, maxM0 = {}", n, dim, m, max_m0);
+
+    // every element of the level-0 block is its level-0 list (the count in the
+    // low 16 bits, the deletion mark in the third byte), its vector and label
+    const size_t size_level0 = size_element * n;
+    const size_t off_link = sizeof(header) + size_level0;
+    if (size_file < off_link) throw std::runtime_error("Truncated hnswlib index");
+    std::shared_ptr<void> level0(
+        huge_page_pool::global().allocate((size_level0 + 64) / 64 * 64),
+        huge_page_pool::deallocate);
+    char *block = static_cast<char *>(level0.get());
+    read_parallel(fd, block, size_level0, sizeof(header));
+    auto element = [&](size_t i) {
+        return block + i * size_element;
+    };
+
+    // then the upper lists of every element, prefixed by their size in bytes
+    const size_t size_link = size_file - off_link;
+    const size_t size_links = sizeof(uint32_t) * (max_m + 1);
+    auto buffer = parlay::sequence<char>::uninitialized(size_link);
+    read_parallel(fd, buffer.data(), size_link, off_link);
+    parlay::sequence<size_t> offset_link(n);
+    size_t off = 0;
+    for (node_id i = 0; i < n; ++i) {
+        offset_link[i] = off;
+        uint32_t size;
+        if (off + sizeof(size) > size_link) throw std::runtime_error("Truncated hnswlib index");
+        memcpy(&size, &buffer[off], sizeof(size));
+        if (size % size_links) throw std::runtime_error("Unrecognized hnswlib index");
+        off += sizeof(size) + size;
+    }
+    if (off > size_link) throw std::runtime_error("Truncated hnswlib index");
+
+    auto label = parlay::tabulate(n, [&](size_t i) {
+        size_t l;
+        memcpy(&l, element(i) + offset_label, sizeof(l));
+        return l;
+    });
+    if (parlay::any_of(label, [](size_t l) {
+    return l > std::numeric_limits<node_id>::max();
+    }))
+    throw std::runtime_error("Labels do not fit in the ids");
+    auto level = parlay::tabulate(n, [&](size_t i) {
+        uint32_t size;
+        memcpy(&size, &buffer[offset_link[i]], sizeof(size));
+        return uint32_t(size / size_links);
+    });
+
+    if constexpr (std::is_null_pointer_v<G>) {
+        static_assert(std::is_constructible_v<T, node_id, const type_elem *>);
+        // the vectors are served from the block, which is kept with the index
+        mapped.vector = level0;
+        mapped.size_vector = size_level0;
+        node_pool.assign(n, [&](size_t i) {
+            return node{level[i], new_neighbors(level[i]),
+                        T(label[i], reinterpret_cast<const type_elem *>(element(i) + offset_data))};
+        });
+    } else {
+        node_pool.assign(n, [&](size_t i) {
+            return node{level[i], new_neighbors(level[i]),
+                        getter(node_id(label[i]))};
+        });
+    }
+
+    auto copy_list = [](nbh_list &nbh, const char *p) {
+        uint32_t size;
+        memcpy(&size, p, sizeof(size));
+        size &= 0xffff;
+        const auto *ids = reinterpret_cast<const uint32_t *>(p + sizeof(size));
+        nbh.publish(ids, ids + size);
+    };
+    parlay::parallel_for(0, n, [&](size_t i) {
+        node &u = get_node(i);
+        copy_list(neighbourhood(u, 0), element(i));
+        const char *p = &buffer[offset_link[i] + sizeof(uint32_t)];
+        for (uint32_t l = 1; l <= u.level; ++l)
+            copy_list(neighbourhood(u, l), p + (l - 1) * size_links);
+    });
+    if (n > 0) {
+        if (ep >= n || get_node(ep).level != uint32_t(level_max))
+            throw std::runtime_error("Unrecognized hnswlib index");
+        entrance = {ep};
     }
+
+    const size_t cnt_deleted = parlay::count_if(parlay::iota(n.load()), [&](size_t i) {
+        return element(i)[2] & 1;
+    });
+    if (cnt_deleted)
+        spdlog::warn("{} elements marked as deleted are kept as ordinary nodes", cnt_deleted);
+}
+
+template <typename U, template <typename> class Allocator>
+void HNSW<U, Allocator>::read_parallel(int fd, char *buf, size_t size,
+                                       size_t off) {
+    const size_t size_chunk = 1 << 24;
+    std::atomic<bool> failed = false;
+    parlay::parallel_for(0, (size + size_chunk - 1) / size_chunk, [&](size_t c) {
+        size_t done = c * size_chunk;
+        const size_t end = std::min(done + size_chunk, size);
+        while (done < end && !failed) {
+            const ssize_t cnt = pread(fd, buf + done, end - done, off + done);
+            if (cnt == -1 && errno == EINTR) continue;
+            if (cnt <= 0) failed = true;
+            else done += cnt;
+        }
+    }, 1);
+    if (failed) throw std::runtime_error("Failed to read the model");
+}
+
+template <typename U, template <typename> class Allocator>
+void HNSW<U, Allocator>::write_parallel(int fd, const char *buf, size_t size,
+                                        size_t off) {
+    const size_t size_chunk = 1 << 24;
+    std::atomic<bool> failed = false;
+    parlay::parallel_for(0, (size + size_chunk - 1) / size_chunk, [&](size_t c) {
+        size_t done = c * size_chunk;
+        const size_t end = std::min(done + size_chunk, size);
+        while (done < end && !failed) {
+            const ssize_t cnt = pwrite(fd, buf + done, end - done, off + done);
+            if (cnt == -1 && errno == EINTR) continue;
+            if (cnt <= 0) failed = true;
+            else done += cnt;
+        }
+    }, 1);
+    if (failed) throw std::runtime_error("Failed to write the model");
+}
+
+template <typename U, template <typename> class Allocator>
+void HNSW<U, Allocator>::thaw() {
+    if (!mapped.adj) return;
+    if (mapped.level) {
+        node_pool.assign(n, [&](node_id pu) {
+            return node{level_of(pu), nullptr, point_of(pu)};
+        });
+        mapped.level = nullptr;
+        mapped.id = nullptr;
+    }
+    parlay::parallel_for(0, n, [&](node_id pu) {
+        node &u = get_node(pu);
+        u.neighbors = new_neighbors(u.level);
+        for (uint32_t l = 0; l <= u.level; ++l) {
+            const auto nbh = neighbourhood_view(pu, l);
+            neighbourhood(u, l) = nbh;
+        }
+    });
+    // the embedded vectors, if any, are still in use
+    mapped.offset_level = nullptr;
+    mapped.offset_adj = nullptr;
+    mapped.adj = nullptr;
 }
 
 template <typename U, template <typename> class Allocator>
 template <typename Iter>
 HNSW<U, Allocator>::HNSW(Iter begin, Iter end, uint32_t dim_, float m_l_,
                          uint32_t m_, uint32_t ef_construction_, float alpha_,
-                         float batch_base)
+                         float batch_base, const build_control &ctrl)
     : dim(dim_),
       m_l(m_l_),
       m(m_),
       ef_construction(ef_construction_),
       alpha(alpha_),
-      n(std::distance(begin, end)) {
+      n(std::distance(begin, end)),
+      ctrl_build(ctrl),
+      ef_layer(ctrl.ef_schedule.begin(), ctrl.ef_schedule.end()) {
     static_assert(
         std::is_same_v<typename std::iterator_traits<Iter>::value_type, T>);
     static_assert(std::is_base_of_v<
@@ -646,27 +1439,49 @@ HNSW<U, Allocator>::HNSW(Iter begin, Iter end, uint32_t dim_, float m_l_,
     // spdlog::info("idx {} test data: {} {} {}", batch_begin, t[0], t[1], t[2]);
     // spdlog::info("===============================");
 
-    auto seq = parlay::delayed_seq<T>(n, [&](uint32_t i) {
+    auto seq = parlay::delayed_seq<T>(n, [&](size_t i) {
         return *(begin + i);
     });
 
-    const auto level_ep = get_level_random();
-    node_pool.resize(1);
+    if (ctrl_build.bulk_load) {
+        build_bulk(seq);
+        spdlog::info("Index built");
+        return;
+    }
+
     node_id entrance_init = 0;
+    const auto level_ep = get_level(entrance_init);
+    node_pool.resize(1);
     new (&get_node(entrance_init)) node{
-        level_ep, new parlay::sequence<node_id>[level_ep + 1], *seq.begin()
+        level_ep, new_neighbors(level_ep), *seq.begin()
     };
-    entrance.push_back(entrance_init);
+    entrance = {entrance_init};
 
-    uint32_t batch_begin = 0, batch_end = 1, size_limit = n * 0.02;
+    node_id batch_begin = 0, batch_end = 1;
+    const uint32_t size_limit =
+        std::max(ctrl_build.batch_limit.value_or(n * 0.02), 1u);
+    uint32_t size_batch = 1;
     float progress = 0.0;
     while (batch_end < n) {
         batch_begin = batch_end;
-        batch_end = std::min({n, (uint32_t)std::ceil(batch_begin * batch_base) + 1,
-                              batch_begin + size_limit});
+        if (ctrl_build.adaptive_batch)
+            batch_end = std::min(n.load(), batch_begin + size_batch);
+        else
+            batch_end = std::min({n.load(), (node_id)std::ceil(batch_begin * batch_base) + 1,
+                                  node_id(batch_begin + size_limit)});
         spdlog::info("Batch begin {}, batch end {}", batch_begin, batch_end);
         spdlog::info("****************************");
-        insert(seq.begin() + batch_begin, seq.begin() + batch_end, true);
+        const auto stat =
+            insert(seq.begin() + batch_begin, seq.begin() + batch_end, true);
+
+        if (ctrl_build.adaptive_batch) {
+            batch_schedule.push_back({uint32_t(batch_end - batch_begin), stat});
+            size_batch = next_batch_size(batch_end - batch_begin, batch_end, stat,
+                                         batch_base, size_limit);
+            spdlog::info("Batch of {}: {:.3f}s, utilization {:.2f}, missed rank {:.2f}; next {}",
+                         batch_end - batch_begin, stat.time, stat.utilization,
+                         stat.missed_rank, size_batch);
+        }
 
         if (batch_end > n * (progress + 0.05)) {
             progress = float(batch_end) / n;
@@ -674,12 +1489,197 @@ HNSW<U, Allocator>::HNSW(Iter begin, Iter end, uint32_t dim_, float m_l_,
         }
     }
 
+    if (ctrl_build.adaptive_batch) {
+        std::string schedule;
+        for (const auto &[size, stat] : batch_schedule)
+            schedule += std::to_string(size) + ' ';
+        spdlog::info("Batch schedule: {}", schedule);
+    }
     spdlog::info("Index built");
 }
 
+template <typename U, template <typename> class Allocator>
+template <class Seq>
+void HNSW<U, Allocator>::build_bulk(const Seq &seq) {
+    node_pool.resize(n);
+    parlay::parallel_for(0, n, [&](node_id i) {
+        const auto level_u = get_level(i);
+        new (&get_node(i))
+        node{level_u, new_neighbors(level_u), seq[i]};
+    });
+    const uint32_t level_max = parlay::reduce(
+                                   parlay::delayed_seq<uint32_t>(n, [&](size_t i) {
+                                       return get_node(i).level;
+                                   }),
+                                   parlay::maxm<uint32_t>());
+
+    for (uint32_t l_c = 0; l_c <= level_max; ++l_c) {
+        auto subset = parlay::pack_index<node_id>(
+        parlay::delayed_seq<bool>(n, [&](size_t i) {
+            return get_node(i).level >= l_c;
+        }));
+        const size_t size_subset = subset.size();
+        spdlog::info("Bulk-loading lev. {} with {} nodes", l_c, size_subset);
+        if (l_c == level_max) entrance = subset;
+        if (size_subset <= 1) continue;
+
+        const auto m_c = get_threshold_m(l_c);
+        auto cand = get_knn_candidates(subset, std::max(m_c, get_ef_construction(l_c)));
+
+        parlay::sequence<size_t> offset_edge(size_subset);
+        parlay::parallel_for(0, size_subset, [&](size_t i) {
+            auto &u = get_node(subset[i]);
+            for (auto &e : cand[i]) e.u = subset[e.u];
+            neighbourhood(u, l_c) = select_neighbors(u.data, cand[i], m_c, l_c);
+            offset_edge[i] = neighbourhood(u, l_c).size();
+        });
+        cand.clear();
+
+        const size_t cnt_edge = parlay::scan_inplace(offset_edge);
+        auto edge_add =
+            parlay::sequence<std::pair<node_id, node_id>>::uninitialized(cnt_edge);
+        parlay::parallel_for(0, size_subset, [&](size_t i) {
+            const node_id pu = subset[i];
+            auto *edge_u = &edge_add[offset_edge[i]];
+            for (node_id pv : neighbourhood(get_node(pu), l_c).view()) *(edge_u++) = {pv, pu};
+        });
+        add_reverse_edges(edge_add.cut(0, cnt_edge), l_c);
+    }
+}
+
+template <typename U, template <typename> class Allocator>
+auto HNSW<U, Allocator>::get_knn_candidates(
+    const parlay::sequence<node_id> &subset, uint32_t k) const {
+    // The candidates are stored with the positions in `subset` as ids
+    const size_t size_subset = subset.size();
+    auto f_dist = [&](size_t i, size_t j) {
+        return U::distance(get_node(subset[i]).data, get_node(subset[j]).data, dim);
+    };
+    parlay::sequence<parlay::sequence<dist>> cand(size_subset);
+
+    // keep the k nearest distinct ones of the existing and the new candidates
+    auto merge = [&](parlay::sequence<dist> &c, parlay::sequence<dist> &&more) {
+        more.append(c);
+        std::sort(more.begin(), more.end(), [](const dist &a, const dist &b) {
+            return a.u < b.u;
+        });
+        more.erase(std::unique(more.begin(), more.end(),
+        [](const dist &a, const dist &b) {
+            return a.u == b.u;
+        }),
+        more.end());
+        if (more.size() > k) {
+            std::nth_element(more.begin(), more.begin() + k, more.end());
+            more.resize(k);
+        }
+        std::sort(more.begin(), more.end());
+        c = std::move(more);
+    };
+
+    // 1. Brute-force the leaves of random two-pivot partition trees
+    const uint32_t size_leaf = std::max(ctrl_build.bulk_leaf_size, 2u);
+    auto search_leaf = [&](parlay::slice<node_id *, node_id *> ids) {
+        parlay::parallel_for(0, ids.size(), [&](size_t i) {
+            parlay::sequence<dist> near;
+            near.reserve(ids.size() - 1);
+            for (size_t j = 0; j < ids.size(); ++j) {
+                if (j != i) near.push_back({f_dist(ids[i], ids[j]), ids[j]});
+            }
+            merge(cand[ids[i]], std::move(near));
+        });
+    };
+    auto split = [&](auto &self, parlay::slice<node_id *, node_id *> ids,
+    uint64_t h) -> void {
+        const size_t size_ids = ids.size();
+        if (size_ids <= size_leaf) return search_leaf(ids);
+
+        const node_id pa = ids[h % size_ids];
+        const node_id pb = ids[(h % size_ids + 1 + parlay::hash64(h) % (size_ids - 1)) %
+                               size_ids];
+        auto side = parlay::tabulate(size_ids, [&](size_t i) -> bool {
+            return f_dist(ids[i], pb) < f_dist(ids[i], pa);
+        });
+        auto [ids_split, size_left] = parlay::split_two(ids, side);
+        parlay::parallel_for(0, size_ids, [&](size_t i) {
+            ids[i] = ids_split[i];
+        });
+        // fall back to an even split on degenerate (e.g., duplicate) points
+        if (size_left == 0 || size_left == size_ids) size_left = size_ids / 2;
+
+        parlay::par_do(
+        [&] { self(self, ids.cut(0, size_left), parlay::hash64(h ^ 1)); },
+        [&] { self(self, ids.cut(size_left, size_ids), parlay::hash64(h ^ 2)); });
+    };
+    const uint64_t seed = ctrl_build.seed.value_or(0);
+    for (uint32_t t = 0; t < ctrl_build.bulk_num_tree; ++t) {
+        auto ids = parlay::tabulate(size_subset, [](size_t i) {
+            return node_id(i);
+        });
+        split(split, parlay::make_slice(ids), parlay::hash64(seed ^ parlay::hash64(t)));
+    }
+
+    // 2. Refine them by joining the nearest neighbors of the nearest neighbors
+    const uint32_t size_join = std::min(k, 12u);
+    for (uint32_t r = 0; r < ctrl_build.bulk_num_round; ++r) {
+        cand = parlay::tabulate(size_subset, [&](size_t i) {
+            const auto &c = cand[i];
+            parlay::sequence<dist> more;
+            for (size_t a = 0; a < std::min<size_t>(c.size(), size_join); ++a) {
+                const auto &c_a = cand[c[a].u];
+                for (size_t b = 0; b < std::min<size_t>(c_a.size(), size_join); ++b) {
+                    const node_id w = c_a[b].u;
+                    if (w != i) more.push_back({f_dist(i, w), w});
+                }
+            }
+            auto res = c;
+            merge(res, std::move(more));
+            return res;
+        });
+    }
+    return cand;
+}
+
+template <typename U, template <typename> class Allocator>
+uint32_t HNSW<U, Allocator>::next_batch_size(uint32_t size_batch,
+        size_t size_graph,
+        const batch_stat &stat,
+        float batch_base,
+        uint32_t size_limit) const {
+    // Shrink the batch once too many new nodes miss closer peers of the same
+    // batch, which hurts the graph quality. Otherwise grow it as long as the
+    // workers are starved or the quality leaves room for it, while keeping it
+    // proportional to the graph built so far as the doubling schedule does
+    // the measured utilization and the number of workers vary from run to run
+    const bool starved = !ctrl_build.seed &&
+                         stat.utilization < ctrl_build.target_utilization;
+    const uint32_t size_min =
+        ctrl_build.seed ? 1 : std::min<uint32_t>(parlay::num_workers(), size_limit);
+    uint32_t size_next = size_batch;
+    if (stat.missed_rank > ctrl_build.max_missed_rank)
+        size_next = size_batch / 2;
+    else if (starved || stat.missed_rank < ctrl_build.max_missed_rank / 2)
+        size_next = std::ceil(size_batch * batch_base);
+    const uint32_t size_max =
+        std::min<double>(std::ceil(size_graph * (batch_base - 1)) + 1, size_limit);
+    return std::max(size_min, std::min({size_next, size_max, size_limit}));
+}
+
 template <typename U, template <typename> class Allocator>
 template <typename Iter>
-void HNSW<U, Allocator>::insert(Iter begin, Iter end, bool from_blank) {
+auto HNSW<U, Allocator>::insert(Iter begin, Iter end, bool from_blank)
+-> batch_stat {
+    thaw();
+    using clock = std::chrono::steady_clock;
+    const auto time_begin = clock::now();
+    // the time each worker spends on the nodes, to measure the utilization
+    parlay::sequence<double> time_busy(parlay::num_workers());
+    auto measure = [&](auto &&f) {
+        if (!ctrl_build.adaptive_batch) return f();
+        const auto t = clock::now();
+        f();
+        time_busy[parlay::worker_id()] +=
+            std::chrono::duration<double>(clock::now() - t).count();
+    };
     const auto level_ep = get_node(entrance[0]).level;
     const auto size_batch = std::distance(begin, end);
     auto node_new = std::make_unique<node_id[]>(size_batch);
@@ -688,21 +1688,19 @@ void HNSW<U, Allocator>::insert(Iter begin, Iter end, bool from_blank) {
 
     spdlog::info("size batch {}", size_batch);
 
-    const auto factor_m = 1;
-
     spdlog::info("Insert {} elements; from blank? [{}]", size_batch, from_blank ? 'Y' : 'N');
 
     // 1. Query the nearest point as the starting point for each node to insert
     if (from_blank) {
         auto offset = node_pool.size();
-        node_pool.resize(offset + size_batch);
+        grow_pool(offset + size_batch);
 
         parlay::parallel_for(0, size_batch, [&](uint32_t i) {
             const T &q = *(begin + i);
-            const auto level_u = get_level_random();
             node_id pu = offset + i;
+            const auto level_u = get_level(pu);
             new (&get_node(pu))
-            node{level_u, new parlay::sequence<node_id>[level_u + 1], q};
+            node{level_u, new_neighbors(level_u), q};
             node_new[i] = pu;
 
             // auto *a = get_node(pu).data.coord;
@@ -717,99 +1715,118 @@ void HNSW<U, Allocator>::insert(Iter begin, Iter end, bool from_blank) {
     spdlog::info("Nodes are settled, node_pool size : {}", node_pool.size());
 
     parlay::parallel_for(0, size_batch, [&](uint32_t i) {
-        auto &u = get_node(node_new[i]);
-
-        auto *a = u.data.coord;
-        // spdlog::info("new idx {} node {} {} {}", i, a[0], a[1], a[2]);
-
-        const auto level_u = u.level;
-        auto &eps_u = eps[i];
-        eps_u = entrance;
+        measure([&] {
+            auto &u = get_node(node_new[i]);
 
-        uint32_t ef_construction = 200; // DJY TODO
+            const auto level_u = u.level;
+            auto &eps_u = eps[i];
+            eps_u = parlay::to_sequence(entrance.view());
 
-        for (uint32_t l = level_ep; l > level_u; --l) {
-            const auto res = search_layer(u, eps_u, ef_construction, l);
-            eps_u.clear();
-            eps_u.push_back(res[0].u);
-        }
+            for (uint32_t l = level_ep; l > level_u; --l) {
+                const auto ef = ctrl_build.ef_descent.value_or(get_ef_construction(l));
+                const auto res = search_layer(u, eps_u, ef, l);
+                eps_u.clear();
+                eps_u.push_back(res[0].u);
+            }
+        });
     });
 
     debug_output("Finish searching entrances\n");
+    batch_stat stat{};
+    // The new edges of every layer are scattered into one flat buffer, which
+    // is sized once from the maximal degree and reused from layer to layer
+    auto edge_add = parlay::sequence<std::pair<node_id, node_id>>::uninitialized(
+                        size_batch * get_threshold_m(0));
+    parlay::sequence<size_t> offset_edge(size_batch);
+    // The reverse edges are what makes the new nodes reachable by searches, so
+    // they are added once the nodes have their lists on every level, level 0
+    // first. Searching a level never reads the lists of the others, hence the
+    // graph is the same as when adding them level by level
+    parlay::sequence<parlay::sequence<std::pair<node_id, node_id>>> edge_upper(level_ep + 1);
+    size_t cnt_edge_0 = 0;
+    // the numbers of candidates and the unused ones to adapt ef_construction
+    parlay::sequence<uint32_t> cnt_cand, cnt_tail;
+    // the adjacency lists to write to the delta log
+    parlay::sequence<list_ref> list_changed;
+    if (ctrl_build.adaptive_ef) {
+        cnt_cand.resize(size_batch);
+        cnt_tail.resize(size_batch);
+        while (ef_layer.size() <= level_ep)
+            ef_layer.push_back(get_ef_construction(ef_layer.size()));
+    }
     // then we process them layer by layer (from high to low)
     for (int32_t l_c = level_ep; l_c >= 0; --l_c)
     {
-        parlay::sequence<parlay::sequence<std::pair<node_id, node_id>>> edge_add(
-            size_batch);
-
+        const auto ef_c = get_ef_construction(l_c);
         debug_output("Finding neighbors on lev. %d\n", l_c);
         parlay::parallel_for(0, size_batch, [&](uint32_t i) {
             node_id pu = node_new[i];
             auto &u = get_node(pu);
+            offset_edge[i] = 0;
+            if (ctrl_build.adaptive_ef) cnt_cand[i] = cnt_tail[i] = 0;
             if ((uint32_t)l_c > u.level) return;
 
-            auto &eps_u = eps[i];
+            measure([&] {
+                auto &eps_u = eps[i];
 
-            // spdlog::info("EPS-U SIZE {} EPS INDEX {}", eps_u.size(), i);
+                // spdlog::info("EPS-U SIZE {} EPS INDEX {}", eps_u.size(), i);
 
-            auto res = search_layer(u, eps_u, ef_construction, l_c);
-            auto neighbors_vec = select_neighbors(
-                                     u.data, res, get_threshold_m(l_c), l_c);
-            auto &edge_u = edge_add[i];
+                auto res = search_layer(u, eps_u, ef_c, l_c);
+                if (ctrl_build.adaptive_ef) {
+                    cnt_cand[i] = res.size();
+                    nbh_new[i] = select_neighbors(u.data, res, get_threshold_m(l_c), l_c,
+                                                  false, false, &cnt_tail[i]);
+                } else
+                    nbh_new[i] = select_neighbors(u.data, res, get_threshold_m(l_c), l_c);
+                offset_edge[i] = nbh_new[i].size();
 
-            edge_u.clear();
-            edge_u.reserve(neighbors_vec.size());
+                eps_u.clear();
+                eps_u.reserve(res.size());
+                for (const auto e : res) eps_u.push_back(e.u);
+            });
+        });
 
-            for (node_id pv : neighbors_vec) edge_u.emplace_back(pv, pu);
-            nbh_new[i] = std::move(neighbors_vec);
+        if (l_c == 0 && ctrl_build.adaptive_batch)
+            stat.missed_rank = get_missed_rank(node_new.get(), nbh_new.get(), size_batch);
 
-            eps_u.clear();
-            eps_u.reserve(res.size());
-            for (const auto e : res) eps_u.push_back(e.u);
-        });
+        if (ctrl_build.adaptive_ef) {
+            auto sum = [&](const parlay::sequence<uint32_t> &cnt) {
+                return parlay::reduce(parlay::delayed_seq<size_t>(
+                size_batch, [&](size_t i) { return cnt[i]; }));
+            };
+            adapt_ef_construction(l_c, sum(cnt_cand), sum(cnt_tail));
+        }
 
         debug_output("Adding forward edges\n");
+        const size_t cnt_edge = parlay::scan_inplace(offset_edge);
         parlay::parallel_for(0, size_batch, [&](uint32_t i) {
-            auto &u = get_node(node_new[i]);
-            if ((uint32_t)l_c <= u.level)
-                neighbourhood(u, l_c) = std::move(nbh_new[i]);
-        });
+            node_id pu = node_new[i];
+            auto &u = get_node(pu);
+            if ((uint32_t)l_c > u.level) return;
 
-        debug_output("Adding reverse edges\n");
-        // now we add edges in the other direction
-        auto edge_add_flatten = parlay::flatten(edge_add);
-        auto edge_add_grouped = parlay::group_by_key(edge_add_flatten);
-
-        parlay::parallel_for(0, edge_add_grouped.size(), [&](size_t j) {
-            node_id pv = edge_add_grouped[j].first;
-            auto &nbh_v = neighbourhood(get_node(pv), l_c);
-            auto &nbh_v_add = edge_add_grouped[j].second;
-
-            const uint32_t size_nbh_total = nbh_v.size() + nbh_v_add.size();
-
-            const auto m_s = get_threshold_m(l_c) * factor_m;
-            if (size_nbh_total > m_s) {
-                auto candidates = parlay::sequence<dist>(size_nbh_total);
-                for (size_t k = 0; k < nbh_v.size(); ++k) {
-                    candidates[k] =
-                        dist{U::distance(get_node(nbh_v[k]).data, get_node(pv).data, dim),
-                             nbh_v[k]};
-                    // spdlog::info("distance {}", U::distance(get_node(nbh_v[k]).data, get_node(pv).data, dim));
-                }
-                for (size_t k = 0; k < nbh_v_add.size(); ++k)
-                    candidates[k + nbh_v.size()] = dist{
-                    U::distance(get_node(nbh_v_add[k]).data, get_node(pv).data, dim),
-                    nbh_v_add[k]};
+            auto *edge_u = &edge_add[offset_edge[i]];
+            for (node_id pv : nbh_new[i]) *(edge_u++) = {pv, pu};
+            neighbourhood(u, l_c) = nbh_new[i];
+            nbh_new[i].clear();
+        });
 
-                std::sort(candidates.begin(), candidates.end(), farthest());
+        if (log_delta) {
+            list_changed.append(parlay::delayed_seq<list_ref>(cnt_edge * 2, [&](size_t i) {
+                const auto &e = edge_add[i / 2];
+                return list_ref{i % 2 ? e.second : e.first, uint32_t(l_c)};
+            }));
+        }
 
-                nbh_v.resize(m_s);
-                for (size_t k = 0; k < m_s; ++k) nbh_v[k] = candidates[k].u;
-            } else
-                nbh_v.insert(nbh_v.end(), nbh_v_add.begin(), nbh_v_add.end());
-        });
+        if (l_c > 0) edge_upper[l_c] = parlay::to_sequence(edge_add.cut(0, cnt_edge));
+        else cnt_edge_0 = cnt_edge;
     }
 
+    debug_output("Adding reverse edges\n");
+    // now we add edges in the other direction
+    add_reverse_edges(edge_add.cut(0, cnt_edge_0), 0);
+    for (uint32_t l_c = 1; l_c <= level_ep; ++l_c)
+        add_reverse_edges(edge_upper[l_c].cut(0, edge_upper[l_c].size()), l_c);
+
     debug_output("Updating entrance\n");
     // finally, update the entrance
     node_id node_highest =
@@ -818,17 +1835,248 @@ void HNSW<U, Allocator>::insert(Iter begin, Iter end, bool from_blank) {
         return get_node(u).level < get_node(v).level;
     });
     if (get_node(node_highest).level > level_ep) {
-        entrance.clear();
-        entrance.push_back(node_highest);
-        debug_output("New entrance [%u] at lev %u\n",
-                     U::get_id(get_node(node_highest).data),
+        entrance = {node_highest};
+        debug_output("New entrance [%zu] at lev %u\n",
+                     size_t(U::get_id(get_node(node_highest).data)),
                      get_node(node_highest).level);
     } else if (get_node(node_highest).level == level_ep) {
-        entrance.push_back(node_highest);
-        debug_output("New entrance [%u] at lev %u\n",
-                     U::get_id(get_node(node_highest).data),
+        auto eps_new = parlay::to_sequence(entrance.view());
+        eps_new.push_back(node_highest);
+        entrance = eps_new;
+        debug_output("New entrance [%zu] at lev %u\n",
+                     size_t(U::get_id(get_node(node_highest).data)),
                      get_node(node_highest).level);
     }
+
+    n = std::max<size_t>(n, node_pool.size());
+    if (log_delta) append_log(node_new.get(), size_batch, std::move(list_changed));
+    // free the lists replaced by this batch once the searches that may have
+    // loaded them have finished
+    epoch_domain::global().reclaim();
+
+    stat.time = std::chrono::duration<double>(clock::now() - time_begin).count();
+    stat.utilization = parlay::reduce(time_busy) / (stat.time * time_busy.size());
+    return stat;
+}
+
+template <typename U, template <typename> class Allocator>
+float HNSW<U, Allocator>::get_missed_rank(const node_id *node_new,
+        const parlay::sequence<node_id> *nbh_new,
+        uint32_t size_batch) const {
+    // For a sample of the new nodes, count the batch peers (also sampled)
+    // that are closer than the nearest neighbor it found in the graph. Peers
+    // of the same batch cannot see each other, so this estimates the average
+    // rank of the new neighbors among the ones the batching hides
+    const uint32_t size_sample = std::min(size_batch, 32u);
+    const uint32_t size_peer = std::min(size_batch, 256u);
+    auto missed = parlay::delayed_seq<float>(size_sample, [&](size_t i) {
+        const size_t idx_u = i * size_batch / size_sample;
+        const auto &u = get_node(node_new[idx_u]);
+        const auto &nbh_u = nbh_new[idx_u];
+        if (nbh_u.empty()) return 0.f;
+        const auto d_nearest = U::distance(u.data, get_node(nbh_u[0]).data, dim);
+        uint32_t cnt = 0;
+        for (uint32_t j = 0; j < size_peer; ++j) {
+            const auto &v = get_node(node_new[size_t(j) * size_batch / size_peer]);
+            if (&v != &u && U::distance(u.data, v.data, dim) < d_nearest) cnt++;
+        }
+        return float(cnt) * size_batch / size_peer;
+    });
+    return parlay::reduce(missed) / size_sample;
+}
+
+template <typename U, template <typename> class Allocator>
+void HNSW<U, Allocator>::adapt_ef_construction(uint32_t level, size_t cnt_cand,
+        size_t cnt_tail) {
+    if (cnt_cand == 0) return;
+    // The candidates behind the last one kept by the pruning are distance
+    // computations spent for nothing, so shrink ef when they are the
+    // majority. When the kept ones reach into the very end of the
+    // candidate list, a larger ef would probably find more neighbors
+    const float ratio_tail = float(cnt_tail) / cnt_cand;
+    auto &ef = ef_layer[level];
+    const auto ef_old = ef;
+    if (ratio_tail < 0.1)
+        ef = std::min<uint32_t>(ctrl_build.ef_max, std::ceil(ef * 1.25));
+    else if (ratio_tail > 0.5)
+        ef = std::max<uint32_t>(ctrl_build.ef_min, ef * 0.9);
+    if (ef != ef_old)
+        spdlog::info("ef_construction at lev. {}: {} -> {} (unused candidates {})",
+                     level, ef_old, ef, ratio_tail);
+}
+
+template <typename U, template <typename> class Allocator>
+template <class Edges>
+void HNSW<U, Allocator>::add_reverse_edges(Edges &&edges, uint32_t l_c) {
+    // `edges` holds the pairs of (pv, pu) for each new edge pu->pv. We semisort
+    // them by pv in place so that every group is a contiguous range of the
+    // buffer instead of a freshly allocated sequence per node
+    const size_t cnt_edge = edges.size();
+    if (cnt_edge == 0) return;
+    parlay::integer_sort_inplace(edges, [](const std::pair<node_id, node_id> &e) {
+        return e.first;
+    });
+    auto group_begin = parlay::pack_index<size_t>(
+    parlay::delayed_seq<bool>(cnt_edge, [&](size_t j) {
+        return j == 0 || edges[j].first != edges[j - 1].first;
+    }));
+
+    const auto factor_m = 1;
+    const auto m_s = get_threshold_m(l_c) * factor_m;
+    parlay::parallel_for(0, group_begin.size(), [&](size_t j) {
+        const size_t begin = group_begin[j];
+        const size_t end = j + 1 < group_begin.size() ? group_begin[j + 1] : cnt_edge;
+        node_id pv = edges[begin].first;
+        // the list is rebuilt and published, as searches may be reading it
+        const auto nbh_v = neighbourhood(get_node(pv), l_c).view();
+
+        const uint32_t size_nbh_total = nbh_v.size() + (end - begin);
+
+        if (size_nbh_total > m_s) {
+            auto candidates = parlay::sequence<dist>(size_nbh_total);
+            for (size_t k = 0; k < nbh_v.size(); ++k) {
+                candidates[k] =
+                    dist{U::distance(get_node(nbh_v[k]).data, get_node(pv).data, dim),
+                         nbh_v[k]};
+            }
+            for (size_t k = begin; k < end; ++k) {
+                const node_id pu = edges[k].second;
+                candidates[nbh_v.size() + k - begin] =
+                    dist{U::distance(get_node(pu).data, get_node(pv).data, dim), pu};
+            }
+
+            std::sort(candidates.begin(), candidates.end(), farthest());
+
+            neighbourhood(get_node(pv), l_c) =
+            parlay::delayed_seq<node_id>(m_s, [&](size_t k) {
+                return candidates[k].u;
+            });
+        } else {
+            auto nbh_new = parlay::sequence<node_id>::uninitialized(size_nbh_total);
+            std::copy(nbh_v.begin(), nbh_v.end(), nbh_new.begin());
+            for (size_t k = begin; k < end; ++k)
+                nbh_new[nbh_v.size() + k - begin] = edges[k].second;
+            neighbourhood(get_node(pv), l_c) = nbh_new;
+        }
+    });
+}
+
+template <typename U, template <typename> class Allocator>
+void HNSW<U, Allocator>::merge(const HNSW &other, uint32_t ef) {
+    if (other.dim != dim) throw std::runtime_error("Merging indexes of different dimensions");
+    if (other.n == 0) return;
+    thaw();
+    const node_id n_a = n, n_b = other.n;
+    const uint32_t height_a = n_a ? level_of(entrance[0]) : 0;
+    const uint32_t height_b = other.level_of(other.entrance[0]);
+
+    // The nearest nodes of `to` to the point of a node, on every level from
+    // `top` down, each level searched from the results of the one above
+    auto search_cross = [&](const HNSW &to, const node &u, uint32_t top, node_id offset) {
+        parlay::sequence<parlay::sequence<dist>> res(top + 1);
+        auto eps = to.search_layer_to(u, 1, top);
+        for (uint32_t l = top + 1; l-- > 0;) {
+            res[l] = to.search_layer(u, eps, ef, l);
+            eps = parlay::map(res[l], [](const dist &e) {
+                return e.u;
+            });
+            for (dist &e : res[l]) e.u += offset;
+        }
+        return res;
+    };
+    // prune the old neighbors of a node on a level together with `cross`
+    auto relink = [&](node_id pu, uint32_t l, parlay::sequence<dist> &&cross) {
+        node &u = get_node(pu);
+        for (node_id pv : neighbourhood(u, l).view())
+            cross.push_back({U::distance(u.data, get_node(pv).data, dim), pv});
+        const uint32_t m_s = get_threshold_m(l);
+        if (cross.size() <= m_s) {
+            neighbourhood(u, l) = parlay::delayed_seq<node_id>(cross.size(), [&](size_t i) {
+                return cross[i].u;
+            });
+            return;
+        }
+        // keep the degree: the slots left by the heuristic go to the nearest
+        // of the pruned candidates
+        auto nbh = select_neighbors(u.data, cross, m_s, l);
+        if (nbh.size() < m_s) {
+            std::sort(cross.begin(), cross.end());
+            std::unordered_set<node_id> kept(nbh.begin(), nbh.end());
+            for (size_t i = 0; i < cross.size() && nbh.size() < m_s; ++i)
+                if (!kept.count(cross[i].u)) nbh.push_back(cross[i].u);
+        }
+        neighbourhood(u, l) = nbh;
+    };
+
+    // 1. the nodes of `other` are looked up here before this graph changes
+    parlay::sequence<parlay::sequence<parlay::sequence<dist>>> cross_b(n_b);
+    if (n_a) {
+        parlay::parallel_for(0, n_b, [&](node_id pb) {
+            const node u{other.level_of(pb), nullptr, other.point_of(pb)};
+            cross_b[pb] = search_cross(*this, u, std::min(u.level, height_a), 0);
+        }, 1);
+    }
+
+    // 2. append them with their own edges, so that they are searchable as
+    //    soon as any node here links to them
+    for (const auto &p : {other.mapped.region, other.mapped.vector})
+        if (p) mapped.merged.push_back(p);
+    mapped.merged.insert(mapped.merged.end(), other.mapped.merged.begin(),
+                         other.mapped.merged.end());
+    grow_pool(n_a + n_b);
+    parlay::parallel_for(0, n_b, [&](node_id pb) {
+        const uint32_t level = other.level_of(pb);
+        new (&get_node(n_a + pb)) node{level, new_neighbors(level), other.point_of(pb)};
+        for (uint32_t l = 0; l <= level; ++l) {
+            neighbourhood(get_node(n_a + pb), l) =
+                parlay::delayed_seq<node_id>(other.neighbourhood_view(pb, l).size(),
+            [&, nbh = other.neighbourhood_view(pb, l)](size_t i) {
+                return nbh[i] + n_a;
+            });
+        }
+    });
+    n = n_a + n_b;
+
+    // 3. the nodes here take their neighbors from `other` and every list only
+    //    changes its own node, so the levels need no synchronization
+    parlay::parallel_for(0, n_a, [&](node_id pa) {
+        const node &u = get_node(pa);
+        const uint32_t top = std::min(u.level, height_b);
+        auto cross = search_cross(other, u, top, n_a);
+        for (uint32_t l = 0; l <= top; ++l) relink(pa, l, std::move(cross[l]));
+    }, 1);
+    if (n_a) {
+        parlay::parallel_for(0, n_b, [&](node_id pb) {
+            for (uint32_t l = 0; l < cross_b[pb].size(); ++l)
+                relink(n_a + pb, l, std::move(cross_b[pb][l]));
+        }, 1);
+    }
+
+    auto eps_b = parlay::map(other.entrance.view(), [&](node_id pe) {
+        return node_id(pe + n_a);
+    });
+    if (n_a == 0 || height_b > height_a) {
+        entrance = eps_b;
+    } else if (height_b == height_a) {
+        auto eps_new = parlay::to_sequence(entrance.view());
+        eps_new.append(eps_b);
+        entrance = eps_new;
+    }
+    spdlog::info("Merged {} nodes into {}", n_b, n_a);
+
+    if (log_delta) {
+        // every list here may have been replaced
+        auto list_changed = parlay::flatten(parlay::tabulate(n_a, [&](node_id pa) {
+            return parlay::tabulate(std::min(get_node(pa).level, height_b) + 1, [&](uint32_t l) {
+                return list_ref{pa, l};
+            });
+        }));
+        auto node_new = parlay::tabulate(n_b, [&](node_id pb) {
+            return node_id(n_a + pb);
+        });
+        append_log(node_new.data(), n_b, std::move(list_changed));
+    }
+    epoch_domain::global().reclaim();
 }
 
 template <class Conn, class G, class D, class Seq>
@@ -905,14 +2153,10 @@ auto HNSW<U, Allocator>::search_layer(const node &u,
 
     QueryParams QP(ef, ef, 1.35, ctrl.limit_eval.value_or(n),
                    get_threshold_m(l_c));
-    auto points = parlay::delayed_seq<const T &>(
-                      node_pool.size(),
-                      [&](size_t i) -> const T & { return node_pool[i].data; });
-
     bool use_filtering = false;
 
     using dtype = float;
-    using indexType = uint32_t;
+    using indexType = node_id;
     using id_dist = std::pair<indexType, dtype>;
     int beamSize = QP.beamSize;
 
@@ -929,7 +2173,9 @@ auto HNSW<U, Allocator>::search_layer(const node &u,
     };
 
     int bits = std::max<int>(10, std::ceil(std::log2(beamSize * beamSize)) - 2);
-    std::vector<indexType> hash_filter(1 << bits, -1);
+    // kept by the thread across the searches, in index memory
+    thread_local std::vector<indexType, huge_page_allocator<indexType>> hash_filter;
+    hash_filter.assign(1 << bits, indexType(-1));
     auto has_been_seen = [&](indexType a) -> bool {
         int loc = parlay::hash64_2(a) & ((1 << bits) - 1);
         if (hash_filter[loc] == a) return true;
@@ -941,13 +2187,14 @@ auto HNSW<U, Allocator>::search_layer(const node &u,
     frontier.reserve(beamSize);
 
     for (auto q : eps) {
-        const auto *uc = get_node(q).data.coord;
-        frontier.push_back(id_dist(q, U::distance(get_node(q).data, u.data, dim)));
+        frontier.push_back(id_dist(q, U::distance(point_of(q), u.data, dim)));
         has_been_seen(q);
     }
     std::sort(frontier.begin(), frontier.end(), less);
 
-    std::vector<id_dist> unvisited_frontier(beamSize);
+    // the entrance may have more points than a small ef
+    std::vector<id_dist> unvisited_frontier(
+        std::max<size_t>(beamSize, frontier.size()));
     for (int i = 0; i < frontier.size(); i++) unvisited_frontier[i] = frontier[i];
 
     std::vector<id_dist> visited;
@@ -972,8 +2219,16 @@ auto HNSW<U, Allocator>::search_layer(const node &u,
     dtype filter_threshold;
 
     int offset = 0;
+    // the clock is read once every few expansions
+    const uint32_t mask_check_time = 7;
 
     while (remain > offset && num_visited < QP.limit) {
+        if ((ctrl.limit_dist && full_dist_cmps >= *ctrl.limit_dist) ||
+                (ctrl.deadline && (num_visited & mask_check_time) == 0 &&
+                 std::chrono::steady_clock::now() >= *ctrl.deadline)) {
+            if (ctrl.truncated) **ctrl.truncated = true;
+            break;
+        }
         id_dist current = unvisited_frontier[offset];
         g[current.first].prefetch();
 
@@ -985,7 +2240,7 @@ auto HNSW<U, Allocator>::search_layer(const node &u,
 
         if (use_filtering && frontier_full) {
             filter_threshold_sum +=
-                U::distance(get_node(frontier.back().first).data, u.data, dim);
+                U::distance(point_of(frontier.back().first), u.data, dim);
             filter_threshold_count++;
             filter_threshold = filter_threshold_sum / filter_threshold_count;
         }
@@ -1004,7 +2259,7 @@ auto HNSW<U, Allocator>::search_layer(const node &u,
         if (use_filtering && frontier_full) {
             for (auto a : pruned) {
                 if (frontier_full &&
-                        U::distance(get_node(a).data, u.data, dim) >= filter_threshold)
+                        U::distance(point_of(a), u.data, dim) >= filter_threshold)
                     continue;
                 filtered.push_back(a);
                 // points[a].prefetch();
@@ -1016,7 +2271,7 @@ auto HNSW<U, Allocator>::search_layer(const node &u,
             (frontier_full ? frontier[frontier.size() - 1].second
              : (distanceType)std::numeric_limits<int>::max());
         for (auto a : filtered) {
-            distanceType dist = U::distance(get_node(a).data, u.data, dim);
+            distanceType dist = U::distance(point_of(a), u.data, dim);
             full_dist_cmps++;
             // skip if frontier not full and distance too large
             if (dist >= cutoff) continue;
@@ -1083,7 +2338,7 @@ auto HNSW<U, Allocator>::search_layer_bak(const node &u,
 #ifdef USE_HASHTBL
     const uint32_t bits = ef > 2 ? std::ceil(std::log2(ef * ef)) - 2 : 2;
     const uint32_t mask = (1u << bits) - 1;
-    parlay::sequence<uint32_t> visited(mask + 1, n + 1);
+    parlay::sequence<node_id> visited(mask + 1, n + 1);
 #endif
 #ifdef USE_BOOLARRAY
     std::vector<bool> visited(n + 1);
@@ -1092,7 +2347,7 @@ auto HNSW<U, Allocator>::search_layer_bak(const node &u,
     // TODO: monitor the size of `visited`
     uint32_t cnt_visited = 0;
 #ifdef USE_UNORDERED_SET
-    std::unordered_set<uint32_t> visited;
+    std::unordered_set<node_id> visited;
 #endif
     parlay::sequence<dist> W, discarded;
     std::set<dist, farthest> C;
@@ -1148,7 +2403,7 @@ auto HNSW<U, Allocator>::search_layer_bak(const node &u,
         // std::pop_heap(C.begin(), C.end(), nearest());
         // C.pop_back();
         C.erase(C.begin());
-        for (node_id pv : neighbourhood(c, l_c)) {
+        for (node_id pv : neighbourhood(c, l_c).view()) {
 #ifdef USE_HASHTBL
             const auto id = U::get_id(get_node(pv).data);
             const auto idx = parlay::hash64_2(id) & mask;
@@ -1228,7 +2483,7 @@ auto HNSW<U, Allocator>::search_layer_new_ex(
     // parlay::sequence<bool> visited(n);
     // TODO: Try hash to an array
     // TODO: monitor the size of `visited`
-    std::set<uint32_t> visited;
+    std::set<node_id> visited;
     // std::priority_queue<dist_ex,parlay::sequence<dist_ex>,nearest> C;
     // std::priority_queue<dist_ex,parlay::sequence<dist_ex>,farthest> W;
     parlay::sequence<dist_ex> /*C, W, */ W_;
@@ -1244,7 +2499,7 @@ auto HNSW<U, Allocator>::search_layer_new_ex(
         C_acc.insert({d, ep, 1});
         // C.push_back({d,ep,1});
         // W.push_back({d,ep,1});
-        verbose_output("Insert\t[%u](%f) initially\n", id, d);
+        verbose_output("Insert\t[%zu](%f) initially\n", size_t(id), d);
     }
     // std::make_heap(C.begin(), C.end(), nearest());
     // std::make_heap(W.begin(), W.end(), farthest());
@@ -1283,10 +2538,10 @@ auto HNSW<U, Allocator>::search_layer_new_ex(
         cnt_used++;
 
         verbose_output("------------------------------------\n");
-        const uint32_t id_c = U::get_id(c.data);
-        verbose_output("Eval\t[%u](%f){%u}\t[%u]\n", id_c, it->d, dc, indeg[id_c]);
+        const node_id id_c = U::get_id(c.data);
+        verbose_output("Eval\t[%zu](%f){%u}\t[%u]\n", size_t(id_c), it->d, dc, indeg[id_c]);
         uint32_t cnt_insert = 0;
-        for (node_id pv : neighbourhood(c, l_c)) {
+        for (node_id pv : neighbourhood(c, l_c).view()) {
             // if(visited[U::get_id(get_node(pv).data)]) continue;
             // visited[U::get_id(get_node(pv).data)] = true;
             if (!visited.insert(U::get_id(get_node(pv).data)).second) continue;
@@ -1309,8 +2564,8 @@ auto HNSW<U, Allocator>::search_layer_new_ex(
                 */
                 if (C.size() < ef || d < C.rbegin()->d) {
                     C.insert({d, pv, dc + 1});
-                    const uint32_t id_v = U::get_id(get_node(pv).data);
-                    verbose_output("Insert\t[%u](%f){%u}\t[%u](%f)\n", id_v, d, dc + 1,
+                    const node_id id_v = U::get_id(get_node(pv).data);
+                    verbose_output("Insert\t[%zu](%f){%u}\t[%u](%f)\n", size_t(id_v), d, dc + 1,
                                    indeg[id_v],
                                    U::distance(c.data, get_node(pv).data, dim));
                     cnt_insert++;
@@ -1372,7 +2627,7 @@ auto HNSW<U, Allocator>::beam_search_ex(const node &u,
     // int bits = std::ceil(std::log2(beamSize * beamSize));
     // parlay::sequence<uint32_t> hash_table(1 << bits,
     // std::numeric_limits<uint32_t>::max());
-    std::set<uint32_t> accessed;
+    std::set<node_id> accessed;
 
     auto make_pid = [&](node_id ep) {
         const auto d = U::distance(u.data, get_node(ep).data, dim);
@@ -1405,10 +2660,10 @@ auto HNSW<U, Allocator>::beam_search_ex(const node &u,
         // to p
         dist_ex currentPid = unvisited_frontier[0];
         node_id current_vtx = currentPid.u;
-        debug_output("current_vtx ID: %u\n", U::get_id(get_node(current_vtx).data));
+        debug_output("current_vtx ID: %zu\n", size_t(U::get_id(get_node(current_vtx).data)));
 
         auto g = [&](node_id a) {
-            uint32_t id_a = U::get_id(get_node(a).data);
+            node_id id_a = U::get_id(get_node(a).data);
             /*
             uint32_t loc = parlay::hash64_2(id_a) & ((1 << bits) - 1);
             if (hash_table[loc] == id_a) return false;
@@ -1425,13 +2680,13 @@ auto HNSW<U, Allocator>::beam_search_ex(const node &u,
             }
             return true;
         };
-        for (node_id pv : neighbourhood(get_node(current_vtx), l_c))
+        for (node_id pv : neighbourhood(get_node(current_vtx), l_c).view())
             // current_vtx.out_neighbors().foreach_cond(f);
             f(current_vtx, pv);
 
         debug_output("candidates:\n");
         for (node_id p : candidates)
-            debug_output("%u ", U::get_id(get_node(p).data));
+            debug_output("%zu ", size_t(U::get_id(get_node(p).data)));
         debug_output("\n");
         auto pairCandidates = parlay::map(candidates, make_pid);
         /*
@@ -1457,7 +2712,7 @@ auto HNSW<U, Allocator>::beam_search_ex(const node &u,
 
         debug_output("frontier (size: %lu)\n", frontier.size());
         for (const auto &e : frontier)
-            debug_output("%u ", U::get_id(e.get_node(u).data));
+            debug_output("%zu ", size_t(U::get_id(e.get_node(u).data)));
         debug_output("\n");
 
         frontier =
@@ -1487,14 +2742,16 @@ auto HNSW<U, Allocator>::beam_search_ex(const node &u,
 template <typename U, template <typename> class Allocator>
 parlay::sequence<typename HNSW<U, Allocator>::node_id>
 HNSW<U, Allocator>::search_layer_to(const node &u, uint32_t ef, uint32_t l_stop,
-                                    const search_control &ctrl) {
-    auto eps = entrance;
-    for (uint32_t l_c = get_node(entrance[0]).level; l_c > l_stop; --l_c) {
+                                    const search_control &ctrl) const {
+    auto eps = parlay::to_sequence(entrance.view());
+    for (uint32_t l_c = level_of(eps[0]); l_c > l_stop; --l_c) {
         search_control c{};
         c.log_per_stat =
             ctrl.log_per_stat;  // whether count dist calculations at all layers
         // c.limit_eval = ctrl.limit_eval; // whether apply the limit to all layers
         c.count_cmps = ctrl.count_cmps;
+        c.deadline = ctrl.deadline;
+        c.truncated = ctrl.truncated;
         const auto W = search_layer(u, eps, ef, l_c, c);
         eps.clear();
         eps.push_back(W[0].u);
@@ -1503,15 +2760,18 @@ HNSW<U, Allocator>::search_layer_to(const node &u, uint32_t ef, uint32_t l_stop,
 }
 
 template <typename U, template <typename> class Allocator>
-parlay::sequence<std::pair<uint32_t, float>> HNSW<U, Allocator>::search(
-    const T &q, uint32_t k, uint32_t ef, const search_control &ctrl) {
+auto HNSW<U, Allocator>::search(const T &q, uint32_t k, uint32_t ef,
+                                const search_control &ctrl)
+-> parlay::sequence<std::pair<node_id, float>> {
     const auto id = parlay::worker_id();
     total_range_candidate[id] = 0;
     total_visited[id] = 0;
     total_eval[id] = 0;
     total_size_C[id] = 0;
 
-    node u{n, nullptr, q};  // To optimize
+    epoch_domain::guard guard;  // the lists read stay until it is released
+    if (ctrl.truncated) **ctrl.truncated = false;
+    node u{std::numeric_limits<uint32_t>::max(), nullptr, q};  // To optimize
     // std::priority_queue<dist,parlay::sequence<dist>,farthest> W;
     parlay::sequence<node_id> eps;
     if (ctrl.indicate_ep)
@@ -1527,24 +2787,24 @@ parlay::sequence<std::pair<uint32_t, float>> HNSW<U, Allocator>::search(
         R.resize(k);
     }
 
-    parlay::sequence<std::pair<uint32_t, float>> res;
+    parlay::sequence<std::pair<node_id, float>> res;
     res.reserve(R.size());
 
     for (const auto &e : R)
-        res.push_back({U::get_id(get_node(e.u).data), e.d});
+        res.push_back({U::get_id(point_of(e.u)), e.d});
     return res;
 }
 
 template <typename U, template <typename> class Allocator>
-parlay::sequence<std::pair<uint32_t, float>> HNSW<U, Allocator>::search_exact(
-    const T &q, uint32_t k) {
+auto HNSW<U, Allocator>::search_exact(const T &q, uint32_t k)
+-> parlay::sequence<std::pair<node_id, float>> {
 
-    parlay::sequence<std::pair<uint32_t, float>> results;
-    results.reserve(node_pool.size());
+    parlay::sequence<std::pair<node_id, float>> results;
+    results.reserve(n);
 
-    for (const auto &node : node_pool) {
-        float distance = U::distance(q, node.data, dim);
-        results.push_back({U::get_id(node.data), distance});
+    for (node_id pu = 0; pu < n; ++pu) {
+        const auto p = point_of(pu);
+        results.push_back({U::get_id(p), U::distance(q, p, dim)});
     }
 
     std::sort(results.begin(), results.end(), [](const auto &a, const auto &b) {
@@ -1559,37 +2819,158 @@ parlay::sequence<std::pair<uint32_t, float>> HNSW<U, Allocator>::search_exact(
 }
 
 template <typename U, template <typename> class Allocator>
-void HNSW<U, Allocator>::save(const std::string &filename_model) const {
-    std::ofstream model(filename_model, std::ios::binary);
-    if (!model.is_open()) throw std::runtime_error("Failed to create the model");
+template <class Seq>
+warmup_report HNSW<U, Allocator>::warm_up(const warmup_control &ctrl,
+        const Seq &queries) {
+    using clock = std::chrono::steady_clock;
+    auto seconds_since = [](clock::time_point t) {
+        return std::chrono::duration<double>(clock::now() - t).count();
+    };
+    const size_t size_page = sysconf(_SC_PAGESIZE);
+    auto page_of = [&](const void *p) {
+        return uintptr_t(p) / size_page;
+    };
+    // read one byte of every page so that it is actually faulted in
+    auto touch = [&](const void *begin, size_t size) {
+        if (size == 0) return size_t(0);
+        size_t sum = 0;
+        for (uintptr_t pg = page_of(begin); pg <= page_of((const char *)begin + size - 1);
+                ++pg)
+            sum += *(volatile const char *)std::max(pg * size_page, uintptr_t(begin));
+        return sum;
+    };
+    const size_t size_vec = dim * sizeof(typename U::type_elem);
+    warmup_report report;
+
+    if (ctrl.prefault) {
+        const auto t = clock::now();
+        if (mapped.region) {
+            const size_t size_map =
+                reinterpret_cast<const header_v4 *>(mapped.region.get())->size_file;
+            madvise(mapped.region.get(), size_map, MADV_WILLNEED);
+            const size_t cnt_page = (size_map + size_page - 1) / size_page;
+            parlay::parallel_for(0, cnt_page, [&](size_t i) {
+                touch((const char *)mapped.region.get() + i * size_page, 1);
+            });
+            report.bytes_touched += size_map;
+        }
+        // the vectors may be mapped from the input files; touching them in
+        // order faults their pages in sequentially
+        parlay::parallel_for(0, n, [&](size_t i) {
+            touch(point_of(i)->coord, size_vec);
+        });
+        const char *p = n ? (const char *)point_of(0)->coord : nullptr;
+        const char *base = (const char *)mapped.region.get();
+        const bool in_model = mapped.region && p >= base &&
+                              p < base + reinterpret_cast<const header_v4 *>(base)->size_file;
+        if (!in_model) report.bytes_touched += size_t(n) * size_vec;
+        report.time_prefault = seconds_since(t);
+    }
 
-    const auto size_buffer = 1024 * 1024 * 1024;  // 1G
-    auto buffer = std::make_unique<char[]>(size_buffer);
-    model.rdbuf()->pubsetbuf(buffer.get(), size_buffer);
-
-    const auto write = [&](const auto &data, auto... args) {
-        auto write_impl = [&](auto &f, const auto &data, auto... args) {
-            using T = std::remove_reference_t<decltype(data)>;
-            if constexpr (std::is_pointer_v<std::decay_t<T>>) {
-                auto write_array = [&](const auto &data, size_t size, auto... args) {
-                    for (size_t i = 0; i < size; ++i) f(f, data[i], args...);
-                };
-                // use the array extent as the size
-                if constexpr (sizeof...(args) == 0 && std::is_array_v<T>) {
-                    write_array(data, std::extent_v<T>);
-                } else {
-                    static_assert(sizeof...(args), "size was not provided");
-                    write_array(data, args...);
-                }
-            } else {
-                static_assert(std::is_standard_layout_v<T>);
-                model.write((const char *)&data, sizeof(data));
+    if (ctrl.lock_hot) {
+        const auto t = clock::now();
+        // pages of the upper layers and of the entrance's 2-hop neighborhood
+        auto hot = parlay::filter(parlay::iota<node_id>(n), [&](node_id pu) {
+            return level_of(pu) > 0;
+        });
+        for (node_id pe : entrance.view()) {
+            hot.push_back(pe);
+            for (node_id pv : neighbourhood_view(pe, 0)) {
+                hot.push_back(pv);
+                for (node_id pw : neighbourhood_view(pv, 0)) hot.push_back(pw);
             }
-        };
-        write_impl(write_impl, data, args...);
-    };
+        }
+        auto pages = parlay::flatten(parlay::map(hot, [&](node_id pu) {
+            parlay::sequence<uintptr_t> res;
+            auto add = [&](const void *p, size_t size) {
+                if (size == 0) return;
+                for (auto pg = page_of(p); pg <= page_of((const char *)p + size - 1); ++pg)
+                    res.push_back(pg);
+            };
+            add(point_of(pu)->coord, size_vec);
+            for (uint32_t l = 0; l <= level_of(pu); ++l) {
+                const auto nbh = neighbourhood_view(pu, l);
+                add(nbh.begin(), nbh.size() * sizeof(node_id));
+            }
+            return res;
+        }));
+        pages = parlay::remove_duplicates(pages);
+        parlay::sort_inplace(pages);
+        // lock the runs of consecutive pages
+        size_t cnt_failed = 0;
+        for (size_t i = 0, j; i < pages.size(); i = j) {
+            for (j = i + 1; j < pages.size() && pages[j] == pages[j - 1] + 1; ++j);
+            if (mlock((void *)(pages[i] * size_page), (j - i) * size_page) == 0)
+                report.bytes_locked += (j - i) * size_page;
+            else
+                cnt_failed++;
+        }
+        if (cnt_failed)
+            spdlog::warn("Failed to lock {} ranges of pages ({}); check RLIMIT_MEMLOCK",
+                         cnt_failed, strerror(errno));
+        report.time_lock = seconds_since(t);
+    }
+
+    if (queries.size() > 0) {
+        const auto t = clock::now();
+        parlay::parallel_for(0, queries.size(), [&](size_t i) {
+            search(queries[i], ctrl.k, ctrl.ef);
+        }, 1);
+        report.cnt_query = queries.size();
+        report.time_replay = seconds_since(t);
+    }
+
+    spdlog::info("Warm-up: touched {} MB in {:.3f}s, locked {} MB in {:.3f}s, "
+                 "replayed {} queries in {:.3f}s",
+                 report.bytes_touched >> 20, report.time_prefault,
+                 report.bytes_locked >> 20, report.time_lock, report.cnt_query,
+                 report.time_replay);
+    return report;
+}
+
+template <typename U, template <typename> class Allocator>
+size_t HNSW<U, Allocator>::memory_footprint() const {
+    size_t size = node_pool.capacity() * sizeof(node) + mapped.size_region +
+                  mapped.size_vector;
+    if (mapped.adj) return size;
+    // a list is a block of its size followed by the edges
+    auto size_list = parlay::delayed_seq<size_t>(n, [&](node_id pu) {
+        const node &u = get_node(pu);
+        size_t res = (u.level + 1) * sizeof(nbh_list);
+        for (uint32_t l = 0; l <= u.level; ++l) {
+            const size_t deg = neighbourhood(u, l).size();
+            if (deg) res += sizeof(size_t) + deg * sizeof(node_id);
+        }
+        return res;
+    });
+    return size + parlay::reduce(size_list);
+}
+
+template <typename U, template <typename> class Allocator>
+void HNSW<U, Allocator>::save(const std::string &filename_model,
+                              uint32_t version, type_payload payload) const {
+    if (version == 4) return save_v4(filename_model, payload);
+    if (version != 3) throw std::runtime_error("Unsupported version");
+    if (payload != type_payload::NONE)
+        throw std::runtime_error("Embedded vectors need version 4");
+    if (!fits_32bit()) throw std::runtime_error("The ids need version 4");
+
+    const int fd = open(filename_model.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) throw std::runtime_error("Failed to create the model");
+    std::unique_ptr<int, void (*)(int *)> guard_fd(new int(fd), [](int *fd) {
+        close(*fd);
+        delete fd;
+    });
+
     // write header (version number, type info, etc)
-    write("HNSW", 4);
+    char header[size_header_v3];
+    char *pos = header;
+    auto write = [&](const auto &data) {
+        memcpy(pos, &data, sizeof(data));
+        pos += sizeof(data);
+    };
+    memcpy(pos, "HNSW", 4);
+    pos += 4;
     write(uint32_t(3));  // version
     write(typeid(U).hash_code() ^ sizeof(U));
     fprintf(stderr, "U type written %s\n", typeid(U).name());
@@ -1600,21 +2981,537 @@ void HNSW<U, Allocator>::save(const std::string &filename_model) const {
     write(m);
     write(ef_construction);
     write(alpha);
-    write(n);
-    // write indices
-    for (const auto &u : node_pool) {
-        write(u.level);
-        write(uint32_t(U::get_id(u.data)));
+    write(uint32_t(n));
+    write_parallel(fd, header, sizeof(header), 0);
+
+    // the byte offset of each node's adjacency lists, to write them in place
+    parlay::sequence<size_t> offset_nbh(n);
+    parlay::parallel_for(0, n, [&](node_id pu) {
+        size_t size = 0;
+        for (uint32_t l = 0; l <= level_of(pu); ++l)
+            size += sizeof(size_t) + neighbourhood_view(pu, l).size() * sizeof(uint32_t);
+        offset_nbh[pu] = size;
+    });
+    const size_t size_adj = parlay::scan_inplace(offset_nbh);
+    const size_t off_index = sizeof(header);
+    const size_t off_adj = off_index + size_t(n) * 2 * sizeof(uint32_t);
+    const size_t off_entrance = off_adj + size_adj;
+
+    // every block of nodes is serialized by one worker and written with
+    // pwrite to its own range of the file
+    const size_t size_block = 1 << 16;
+    const size_t cnt_block = (n + size_block - 1) / size_block;
+    parlay::parallel_for(0, cnt_block, [&](size_t b) {
+        const size_t begin = b * size_block;
+        const size_t end = std::min<size_t>(begin + size_block, n);
+        parlay::sequence<uint32_t> index;
+        index.reserve((end - begin) * 2);
+        for (size_t i = begin; i < end; ++i) {
+            index.push_back(level_of(i));
+            index.push_back(uint32_t(U::get_id(point_of(i))));
+        }
+        write_parallel(fd, (const char *)index.data(), index.size() * sizeof(uint32_t),
+                       off_index + begin * 2 * sizeof(uint32_t));
+
+        const size_t size_out = (end == n ? size_adj : offset_nbh[end]) - offset_nbh[begin];
+        auto out = parlay::sequence<char>::uninitialized(size_out);
+        char *p = out.data();
+        for (size_t i = begin; i < end; ++i) {
+            for (uint32_t l = 0; l <= level_of(i); ++l) {
+                const auto nbh = neighbourhood_view(i, l);
+                const size_t size = nbh.size();
+                memcpy(p, &size, sizeof(size));
+                p += sizeof(size);
+                write_id32(p, nbh.begin(), size);
+                p += size * sizeof(uint32_t);
+            }
+        }
+        write_parallel(fd, out.data(), size_out, off_adj + offset_nbh[begin]);
+    }, 1);
+
+    // write entrances
+    const auto eps = entrance.view();
+    parlay::sequence<char> tail(sizeof(size_t) + eps.size() * sizeof(uint32_t));
+    const size_t size_entrance = eps.size();
+    memcpy(tail.data(), &size_entrance, sizeof(size_entrance));
+    write_id32(tail.data() + sizeof(size_entrance), eps.begin(), size_entrance);
+    write_parallel(fd, tail.data(), tail.size(), off_entrance);
+}
+
+template <typename U, template <typename> class Allocator>
+void HNSW<U, Allocator>::save_v4(const std::string &filename_model,
+                                 type_payload payload) const {
+    using type_elem = typename U::type_elem;
+    auto level = parlay::tabulate(n, [&](size_t i) {
+        return level_of(i);
+    });
+    auto id = parlay::tabulate(n, [&](size_t i) {
+        return node_id(U::get_id(point_of(i)));
+    });
+    parlay::sequence<uint64_t> offset_level(n + 1);
+    parlay::parallel_for(0, n, [&](size_t i) {
+        offset_level[i] = level[i] + 1;
+    });
+    offset_level[n] = 0;
+    const uint64_t cnt_list = parlay::scan_inplace(offset_level.cut(0, n));
+    offset_level[n] = cnt_list;
+
+    parlay::sequence<uint64_t> offset_adj(cnt_list + 1);
+    parlay::parallel_for(0, n, [&](node_id pu) {
+        for (uint32_t l = 0; l <= level[pu]; ++l)
+            offset_adj[offset_level[pu] + l] = neighbourhood_view(pu, l).size();
+    });
+    offset_adj[cnt_list] = 0;
+    const uint64_t cnt_edge = parlay::scan_inplace(offset_adj.cut(0, cnt_list));
+    offset_adj[cnt_list] = cnt_edge;
+
+    auto adj = parlay::sequence<node_id>::uninitialized(cnt_edge);
+    parlay::parallel_for(0, n, [&](node_id pu) {
+        for (uint32_t l = 0; l <= level[pu]; ++l) {
+            const auto nbh = neighbourhood_view(pu, l);
+            std::copy(nbh.begin(), nbh.end(), &adj[offset_adj[offset_level[pu] + l]]);
+        }
+    });
+
+    header_v4 header{};
+    memcpy(header.model_type, "HNSW", 4);
+    header.version = 4;
+    header.code_U = typeid(U).hash_code() ^ sizeof(U);
+    header.size_node = sizeof(node);
+    header.dim = dim;
+    header.m_l = m_l;
+    header.m = m;
+    header.ef_construction = ef_construction;
+    header.alpha = alpha;
+    header.n = uint32_t(n);
+    header.size_id = sizeof(node_id);
+    header.cnt_node = n;
+    header.cnt_list = cnt_list;
+    header.cnt_edge = cnt_edge;
+    header.size_entrance = entrance.size();
+
+    uint64_t size_file = sizeof(header);
+    auto place = [&](uint64_t size) {
+        const uint64_t off = (size_file + align_v4 - 1) / align_v4 * align_v4;
+        size_file = off + size;
+        return off;
+    };
+    header.off_level = place(n * sizeof(uint32_t));
+    header.off_id = place(n * sizeof(node_id));
+    header.off_offset_level = place((n + 1) * sizeof(uint64_t));
+    header.off_offset_adj = place((cnt_list + 1) * sizeof(uint64_t));
+    header.off_adj = place(cnt_edge * sizeof(node_id));
+    header.off_entrance = place(entrance.size() * sizeof(node_id));
+
+    // SQ8 stores one byte per dimension and the decoding parameters
+    header.payload = payload;
+    parlay::sequence<float> quant_param;
+    if (payload != type_payload::NONE) {
+        const size_t size_elem =
+            payload == type_payload::RAW ? sizeof(type_elem) : sizeof(uint8_t);
+        header.size_elem = sizeof(type_elem);
+        header.stride_vector = payload == type_payload::RAW
+                               ? (dim * size_elem + 63) / 64 * 64
+                               : dim * size_elem;
+        header.off_vector = place(n * header.stride_vector);
     }
-    for (const auto &u : node_pool) {
-        for (uint32_t l = 0; l <= u.level; ++l) {
-            write(u.neighbors[l].size());
-            for (node_id pv : u.neighbors[l]) write(pv);
+    if (payload == type_payload::SQ8) {
+        if constexpr (!std::is_floating_point_v<type_elem>)
+            throw std::runtime_error("SQ8 payload needs floating-point vectors");
+        quant_param = parlay::tabulate(dim * 2, [&](size_t j) {
+            const auto v = parlay::delayed_seq<float>(n, [&](size_t i) {
+                return float(point_of(i)->coord[j % dim]);
+            });
+            return j < dim ? parlay::reduce(v, parlay::minm<float>())
+                   : parlay::reduce(v, parlay::maxm<float>());
+        });
+        for (uint32_t j = 0; j < dim; ++j)  // max -> scale
+            quant_param[dim + j] = (quant_param[dim + j] - quant_param[j]) / 255;
+        header.off_quant_param = place(dim * 2 * sizeof(float));
+    }
+    header.size_file = size_file;
+
+    std::ofstream model(filename_model, std::ios::binary);
+    if (!model.is_open()) throw std::runtime_error("Failed to create the model");
+    auto write_at = [&](uint64_t off, const void *data, size_t size) {
+        static const char zero[align_v4] = {};
+        model.write(zero, off - model.tellp());
+        model.write(static_cast<const char *>(data), size);
+    };
+    model.write((const char *)&header, sizeof(header));
+    write_at(header.off_level, level.data(), n * sizeof(uint32_t));
+    write_at(header.off_id, id.data(), n * sizeof(node_id));
+    write_at(header.off_offset_level, offset_level.data(), (n + 1) * sizeof(uint64_t));
+    write_at(header.off_offset_adj, offset_adj.data(),
+             (cnt_list + 1) * sizeof(uint64_t));
+    write_at(header.off_adj, adj.data(), cnt_edge * sizeof(node_id));
+    write_at(header.off_entrance, entrance.view().begin(), entrance.size() * sizeof(node_id));
+    if (payload != type_payload::NONE) {
+        const size_t size_block = 1 << 14;
+        parlay::sequence<char> rows(size_block * header.stride_vector);
+        for (size_t begin = 0; begin < n; begin += size_block) {
+            const size_t end = std::min<size_t>(begin + size_block, n);
+            parlay::parallel_for(begin, end, [&](size_t i) {
+                char *row = &rows[(i - begin) * header.stride_vector];
+                const auto *coord = point_of(i)->coord;
+                std::fill(row, row + header.stride_vector, 0);
+                if (payload == type_payload::RAW) {
+                    memcpy(row, coord, dim * sizeof(type_elem));
+                    return;
+                }
+                for (uint32_t j = 0; j < dim; ++j) {
+                    const float scale = quant_param[dim + j];
+                    const float code =
+                        scale > 0 ? std::round((coord[j] - quant_param[j]) / scale) : 0;
+                    row[j] = char(uint8_t(std::clamp(code, 0.f, 255.f)));
+                }
+            });
+            write_at(header.off_vector + begin * header.stride_vector, rows.data(),
+                     (end - begin) * header.stride_vector);
         }
     }
-    // write entrances
-    write(entrance.size());
-    for (node_id pu : entrance) write(pu);
+    if (payload == type_payload::SQ8) {
+        write_at(header.off_quant_param, quant_param.data(),
+                 quant_param.size() * sizeof(float));
+    }
+    if (!model) throw std::runtime_error("Failed to write the model");
+}
+
+template <typename U, template <typename> class Allocator>
+void HNSW<U, Allocator>::save_hnswlib(const std::string &filename_index) const {
+    using type_elem = typename U::type_elem;
+    if (n == 0) throw std::runtime_error("Cannot export an empty index");
+    if (n > std::numeric_limits<uint32_t>::max())
+        throw std::runtime_error("Too many elements for hnswlib");
+    // the lists are capped by the thresholds, but whatever is longer still
+    // has to fit in the fixed slots of the layout
+    auto deg_max = [&](bool upper) {
+        return parlay::reduce(parlay::delayed_seq<uint32_t>(n, [&](node_id pu) {
+            uint32_t res = 0;
+            for (uint32_t l = upper; l <= (upper ? level_of(pu) : 0); ++l)
+                res = std::max<uint32_t>(res, neighbourhood_view(pu, l).size());
+            return res;
+        }), parlay::maxm<uint32_t>());
+    };
+    const size_t max_m0 = std::max(get_threshold_m(0), deg_max(false));
+    const size_t max_m = std::max(get_threshold_m(1), deg_max(true));
+    if (max_m0 > 0xffff || max_m > 0xffff)
+        throw std::runtime_error("Too many neighbors for hnswlib");
+
+    const int fd = open(filename_index.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) throw std::runtime_error("Failed to create the hnswlib index");
+    std::unique_ptr<int, void (*)(int *)> guard_fd(new int(fd), [](int *fd) {
+        close(*fd);
+        delete fd;
+    });
+
+    const size_t size_data = sizeof(type_elem) * dim;
+    const size_t offset_data = sizeof(uint32_t) * (max_m0 + 1);
+    const size_t offset_label = offset_data + size_data;
+    const size_t size_element = offset_label + sizeof(size_t);
+    const size_t size_links = sizeof(uint32_t) * (max_m + 1);
+
+    char header[size_header_hnswlib];
+    char *pos = header;
+    auto write = [&](const auto &data) {
+        memcpy(pos, &data, sizeof(data));
+        pos += sizeof(data);
+    };
+    write(size_t(0));  // offsetLevel0
+    write(size_t(n));  // max_elements
+    write(size_t(n));
+    write(size_element);
+    write(offset_label);
+    write(offset_data);
+    write(int32_t(get_height()));
+    write(uint32_t(entrance[0]));
+    write(max_m);
+    write(max_m0);
+    write(size_t(m));
+    write(double(m_l));
+    write(size_t(ef_construction));
+    write_parallel(fd, header, sizeof(header), 0);
+
+    // the byte offset of each element's upper lists, to write them in place
+    parlay::sequence<size_t> offset_link(n);
+    parlay::parallel_for(0, n, [&](node_id pu) {
+        offset_link[pu] = sizeof(uint32_t) + size_links * level_of(pu);
+    });
+    const size_t size_link = parlay::scan_inplace(offset_link);
+    const size_t off_level0 = sizeof(header);
+    const size_t off_link = off_level0 + size_element * n;
+
+    const size_t size_block = 1 << 16;
+    const size_t cnt_block = (n + size_block - 1) / size_block;
+    parlay::parallel_for(0, cnt_block, [&](size_t b) {
+        const size_t begin = b * size_block;
+        const size_t end = std::min<size_t>(begin + size_block, n);
+        auto write_list = [](char *p, nbh_view nbh) {
+            const uint32_t size = nbh.size();
+            memcpy(p, &size, sizeof(size));
+            write_id32(p + sizeof(size), nbh.begin(), size);
+        };
+
+        parlay::sequence<char> out((end - begin) * size_element);
+        for (size_t i = begin; i < end; ++i) {
+            char *p = &out[(i - begin) * size_element];
+            write_list(p, neighbourhood_view(i, 0));
+            memcpy(p + offset_data, point_of(i)->coord, size_data);
+            const size_t label = U::get_id(point_of(i));
+            memcpy(p + offset_label, &label, sizeof(label));
+        }
+        write_parallel(fd, out.data(), out.size(), off_level0 + begin * size_element);
+
+        const size_t size_out = (end == n ? size_link : offset_link[end]) - offset_link[begin];
+        out = parlay::sequence<char>(size_out);
+        for (size_t i = begin; i < end; ++i) {
+            char *p = &out[offset_link[i] - offset_link[begin]];
+            const uint32_t size = size_links * level_of(i);
+            memcpy(p, &size, sizeof(size));
+            p += sizeof(size);
+            for (uint32_t l = 1; l <= level_of(i); ++l)
+                write_list(p + (l - 1) * size_links, neighbourhood_view(i, l));
+        }
+        write_parallel(fd, out.data(), size_out, off_link + offset_link[begin]);
+    }, 1);
+}
+
+template <typename U, template <typename> class Allocator>
+void HNSW<U, Allocator>::attach_log(const std::string &filename_base,
+                                    const std::string &filename_log,
+                                    uint32_t version_base, bool sync) {
+    if (access(filename_base.c_str(), F_OK) == -1) save(filename_base, version_base);
+
+    auto log = std::make_shared<delta_log>();
+    log->filename_base = filename_base;
+    log->filename_log = filename_log;
+    log->version_base = version_base;
+    log->sync = sync;
+    log->fd = open(filename_log.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (log->fd == -1) throw std::runtime_error("Failed to open the log");
+    const off_t size = lseek(log->fd, 0, SEEK_END);
+    if (size == -1) throw std::runtime_error("Failed to open the log");
+    log->size = size;
+    if (log->size == 0) {
+        write_parallel(log->fd, magic_log, sizeof(magic_log), 0);
+        log->size = sizeof(magic_log);
+    }
+    log_delta = std::move(log);
+}
+
+template <typename U, template <typename> class Allocator>
+void HNSW<U, Allocator>::append_log(const node_id *node_new, uint32_t size_batch,
+                                    parlay::sequence<list_ref> &&list_changed) {
+    // the new nodes have all their lists logged, even the empty ones
+    list_changed.append(parlay::flatten(parlay::tabulate(size_batch, [&](size_t i) {
+        const node_id pu = node_new[i];
+        return parlay::tabulate(get_node(pu).level + 1, [&](uint32_t l) {
+            return list_ref{pu, l};
+        });
+    })));
+    const auto list = parlay::unique(parlay::sort(list_changed));
+    list_changed.clear();
+    const size_t cnt_list = list.size();
+
+    // record: size and checksum of the body, then the body
+    //   n_before, cnt_new, (level, id) of the new nodes,
+    //   cnt_list, (node, level, size, neighbors) of the changed lists,
+    //   size_entrance, entrance; padded to 8 bytes
+    // where n_before and the ids of the nodes and the points are node_id
+    const size_t size_head_list = sizeof(node_id) + 2 * sizeof(uint32_t);
+    const size_t size_new = sizeof(uint32_t) + sizeof(node_id);
+    parlay::sequence<size_t> offset_list(cnt_list);
+    parlay::parallel_for(0, cnt_list, [&](size_t i) {
+        const auto [pu, l] = list[i];
+        offset_list[i] = size_head_list +
+                         neighbourhood(get_node(pu), l).size() * sizeof(node_id);
+    });
+    const size_t size_lists = parlay::scan_inplace(offset_list);
+    const size_t off_nodes = 2 * sizeof(uint64_t) + sizeof(node_id) + sizeof(uint32_t);
+    const size_t off_lists = off_nodes + size_batch * size_new + sizeof(uint64_t);
+    const size_t off_entrance = off_lists + size_lists;
+    const size_t size_record =
+        (off_entrance + sizeof(uint64_t) + entrance.size() * sizeof(node_id) + 7) / 8 * 8;
+
+    parlay::sequence<char> record(size_record, 0);
+    char *body = record.data() + 2 * sizeof(uint64_t);
+    auto put = [](char *p, const auto &v) {
+        memcpy(p, &v, sizeof(v));
+        return p + sizeof(v);
+    };
+    put(put(body, node_id(n - size_batch)), size_batch);
+    parlay::parallel_for(0, size_batch, [&](size_t i) {
+        const node &u = get_node(node_new[i]);
+        put(put(&record[off_nodes + i * size_new], u.level), node_id(U::get_id(u.data)));
+    });
+    put(&record[off_lists - sizeof(uint64_t)], uint64_t(cnt_list));
+    parlay::parallel_for(0, cnt_list, [&](size_t i) {
+        const auto [pu, l] = list[i];
+        const auto nbh = neighbourhood(get_node(pu), l).view();
+        char *p = put(put(put(&record[off_lists + offset_list[i]], pu), l),
+                      uint32_t(nbh.size()));
+        memcpy(p, nbh.begin(), nbh.size() * sizeof(node_id));
+    });
+    memcpy(put(&record[off_entrance], uint64_t(entrance.size())), entrance.view().begin(),
+           entrance.size() * sizeof(node_id));
+    const uint64_t size_body = size_record - 2 * sizeof(uint64_t);
+    put(put(record.data(), size_body), checksum(body, size_body));
+
+    std::lock_guard lock(log_delta->mutex);
+    const int fd = log_delta->fd;
+    write_parallel(fd, record.data(), size_record, log_delta->size);
+    if (log_delta->sync && fdatasync(fd) == -1)
+        throw std::runtime_error("Failed to sync the log");
+    log_delta->size += size_record;
+}
+
+template <typename U, template <typename> class Allocator>
+template <typename G>
+size_t HNSW<U, Allocator>::replay_log(const std::string &filename_log, G getter,
+                                      size_t size_limit) {
+    const int fd = open(filename_log.c_str(), O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) return 0;  // nothing was logged yet
+        throw std::runtime_error("Failed to open the log");
+    }
+    std::unique_ptr<int, void (*)(int *)> guard_fd(new int(fd), [](int *fd) {
+        close(*fd);
+        delete fd;
+    });
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) throw std::runtime_error("Failed to open the log");
+    const size_t size_file = std::min<size_t>(sb.st_size, size_limit);
+    if (size_file == 0) return 0;
+    auto buffer = parlay::sequence<char>::uninitialized(size_file);
+    read_parallel(fd, buffer.data(), size_file, 0);
+    if (size_file < sizeof(magic_log) ||
+            memcmp(buffer.data(), magic_log, sizeof(magic_log)))
+        throw std::runtime_error("Wrong type of log");
+
+    thaw();
+    size_t cnt_applied = 0;
+    size_t off = sizeof(magic_log);
+    while (off < size_file) {
+        auto get = [&](const char *p, auto &v) {
+            memcpy(&v, p, sizeof(v));
+            return p + sizeof(v);
+        };
+        // a torn or corrupted tail ends the replay
+        uint64_t size_body, sum;
+        if (size_file - off < 2 * sizeof(uint64_t)) break;
+        get(get(&buffer[off], size_body), sum);
+        if (size_body > size_file - off - 2 * sizeof(uint64_t)) break;
+        const char *body = &buffer[off + 2 * sizeof(uint64_t)];
+        if (checksum(body, size_body) != sum) break;
+        off += 2 * sizeof(uint64_t) + size_body;
+
+        node_id n_before;
+        uint32_t cnt_new;
+        const char *p = get(get(body, n_before), cnt_new);
+        if (n_before + cnt_new <= n) continue;  // already in the base
+        if (n_before != n) throw std::runtime_error("The log does not continue the model");
+
+        grow_pool(n + cnt_new);
+        const size_t size_new = sizeof(uint32_t) + sizeof(node_id);
+        parlay::parallel_for(0, cnt_new, [&](size_t i) {
+            uint32_t level_u;
+            node_id id_u;
+            get(get(p + i * size_new, level_u), id_u);
+            new (&get_node(n + i))
+            node{level_u, new_neighbors(level_u), getter(id_u)};
+        });
+        n += cnt_new;
+        p += cnt_new * size_new;
+
+        uint64_t cnt_list;
+        p = get(p, cnt_list);
+        parlay::sequence<const char *> pos_list(cnt_list);
+        for (size_t i = 0; i < cnt_list; ++i) {
+            pos_list[i] = p;
+            uint32_t size;
+            get(p + sizeof(node_id) + sizeof(uint32_t), size);
+            p += sizeof(node_id) + 2 * sizeof(uint32_t) + size * sizeof(node_id);
+        }
+        parlay::parallel_for(0, cnt_list, [&](size_t i) {
+            node_id pu;
+            uint32_t l, size;
+            const char *q = get(get(get(pos_list[i], pu), l), size);
+            const auto *nbh = reinterpret_cast<const node_id *>(q);
+            neighbourhood(get_node(pu), l).publish(nbh, nbh + size);
+        });
+
+        uint64_t size_entrance;
+        p = get(p, size_entrance);
+        const auto *ep = reinterpret_cast<const node_id *>(p);
+        entrance.publish(ep, ep + size_entrance);
+        cnt_applied++;
+    }
+    if (off < size_file) spdlog::warn("Ignored {} bytes at the end of the log", size_file - off);
+    spdlog::info("Replayed {} records from the log, n = {}", cnt_applied, n);
+    return cnt_applied;
+}
+
+template <typename U, template <typename> class Allocator>
+std::future<void> HNSW<U, Allocator>::compact() const {
+    if (!log_delta) throw std::runtime_error("No log is attached");
+    return std::async(std::launch::async, [log = log_delta] {
+        compact_log(*log);
+    });
+}
+
+template <typename U, template <typename> class Allocator>
+void HNSW<U, Allocator>::compact_log(delta_log &log) {
+    size_t size_merged;
+    {
+        std::lock_guard lock(log.mutex);
+        size_merged = log.size;
+    }
+    // only the ids of the vectors are saved
+    using type_elem = typename U::type_elem;
+    auto getter = [](node_id id) {
+        return T(id, (const type_elem *)nullptr);
+    };
+    const std::string filename_base_new = log.filename_base + ".compact";
+    const std::string filename_log_new = log.filename_log + ".compact";
+    {
+        HNSW merged(log.filename_base, getter);
+        merged.replay_log(log.filename_log, getter, size_merged);
+        merged.save(filename_base_new, log.version_base);
+    }
+    auto sync_file = [](const std::string &filename) {
+        const int fd = open(filename.c_str(), O_RDONLY);
+        if (fd == -1 || fsync(fd) == -1)
+            throw std::runtime_error("Failed to sync " + filename);
+        close(fd);
+    };
+    sync_file(filename_base_new);
+
+    // move the records appended meanwhile to a new log. The base is replaced
+    // first: a crash in between leaves records that replay skips by their n
+    std::lock_guard lock(log.mutex);
+    const size_t size_log = log.size;
+    auto tail = parlay::sequence<char>::uninitialized(size_log - size_merged);
+    {
+        const int fd = open(log.filename_log.c_str(), O_RDONLY);
+        if (fd == -1) throw std::runtime_error("Failed to open the log");
+        read_parallel(fd, tail.data(), tail.size(), size_merged);
+        close(fd);
+    }
+    const int fd = open(filename_log_new.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) throw std::runtime_error("Failed to create the log");
+    write_parallel(fd, magic_log, sizeof(magic_log), 0);
+    write_parallel(fd, tail.data(), tail.size(), sizeof(magic_log));
+    fsync(fd);
+    close(fd);
+
+    if (rename(filename_base_new.c_str(), log.filename_base.c_str()) == -1 ||
+            rename(filename_log_new.c_str(), log.filename_log.c_str()) == -1)
+        throw std::runtime_error("Failed to replace the base model");
+    close(log.fd);
+    log.fd = open(log.filename_log.c_str(), O_WRONLY);
+    if (log.fd == -1) throw std::runtime_error("Failed to reopen the log");
+    log.size = sizeof(magic_log) + tail.size();
+    spdlog::info("Compacted {} bytes of the log into the base", size_merged);
 }
 
 }  // namespace ANN
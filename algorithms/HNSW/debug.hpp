@@ -8,7 +8,9 @@ extern parlay::sequence<size_t> per_visited;
 extern parlay::sequence<size_t> per_eval;
 extern parlay::sequence<size_t> per_size_C;
 
+#include <chrono>
 #include <optional>
+#include <vector>
 
 struct search_control {
     bool verbose_output;
@@ -21,6 +23,92 @@ struct search_control {
     std::optional<uint32_t> indicate_ep;
     std::optional<uint32_t> limit_eval;
     std::optional<uint32_t*> count_cmps;
+    // stop at the deadline, or once `limit_dist` distances have been computed
+    // on a layer, and return the best found so far; `truncated` tells if the
+    // search stopped early
+    std::optional<std::chrono::steady_clock::time_point> deadline;
+    std::optional<uint32_t> limit_dist;
+    std::optional<bool*> truncated;
+};
+
+struct build_control {
+    // ef used to descend through the layers above the level of a new node
+    // (only the nearest result is kept there); defaults to the layer's ef
+    std::optional<uint32_t> ef_descent;
+    // ef_construction of each layer starting from level 0; the last entry
+    // applies to all higher layers and an empty schedule uses the
+    // `ef_construction` given to the constructor for every layer
+    std::vector<uint32_t> ef_schedule;
+    // adjust the ef of each layer after every batch depending on how many
+    // candidates are discarded behind the last one kept by the pruning,
+    // within the range of [ef_min, ef_max]
+    bool adaptive_ef = false;
+    uint32_t ef_min = 16;
+    uint32_t ef_max = 1024;
+    // pick the size of each batch from the measured worker utilization and
+    // the average number of batch peers that are closer to a new node than
+    // its nearest new neighbor (they cannot see each other while inserting)
+    // instead of growing it by `batch_base` blindly
+    bool adaptive_batch = false;
+    float target_utilization = 0.8;
+    float max_missed_rank = 1;
+    std::optional<uint32_t> batch_limit;  // defaults to 2% of the points
+    // build deterministically: derive the levels from hashes of the node ids
+    // and the seed instead of a per-worker generator, and do not let timing
+    // drive the batch sizes, so the same input yields the same graph at any
+    // number of threads
+    std::optional<uint64_t> seed;
+    // bulk-load instead of inserting the points in batches: build each layer
+    // from a kNN graph of the points on it, obtained from the leaves of
+    // random two-pivot partition trees and refined by joining the neighbors
+    // of neighbors, then prune it and add the reverse edges
+    bool bulk_load = false;
+    uint32_t bulk_num_tree = 4;
+    uint32_t bulk_leaf_size = 128;
+    uint32_t bulk_num_round = 2;
+    // rows per chunk read by HNSW_stream, and the factor of the degree the
+    // graph is built with on the codes before the exact pruning
+    size_t stream_chunk = 1 << 20;
+    float stream_slack = 1.5;
+};
+
+struct warmup_control {
+    // fault in the mapped model and the vectors (MADV_WILLNEED, then touch
+    // every page) instead of letting the first queries do it
+    bool prefault = true;
+    // mlock the upper layers and the 2-hop neighborhoods of the entrance on
+    // level 0, with their vectors; subject to RLIMIT_MEMLOCK
+    bool lock_hot = false;
+    // parameters to replay the sample queries given to warm_up() with
+    uint32_t k = 10;
+    uint32_t ef = 64;
+};
+
+struct server_control {
+    // a batch is dispatched once it holds `batch_max` queries or once its
+    // first query has waited for `wait_max` microseconds
+    uint32_t batch_max = 256;
+    uint32_t wait_max = 500;
+    // queries not answered within `slo` microseconds of their arrival are
+    // cut short (0 for no limit)
+    uint32_t slo = 0;
+    // scale the ef of a batch by `ef_decay` for every `depth_step` queries
+    // left waiting behind it, but not below `ef_floor` (0 to keep the ef)
+    uint32_t depth_step = 0;
+    float ef_decay = 0.8;
+    uint32_t ef_floor = 16;
+    // the socket front end drops the connections asking for a k or an ef
+    // above `ef_max`
+    uint32_t ef_max = 4096;
+};
+
+struct warmup_report {
+    double time_prefault = 0;
+    double time_lock = 0;
+    double time_replay = 0;
+    size_t bytes_touched = 0;
+    size_t bytes_locked = 0;
+    size_t cnt_query = 0;
 };
 
 #endif  // _DEBUG_HPP_
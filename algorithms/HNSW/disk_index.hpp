@@ -0,0 +1,611 @@
+#ifndef _HNSW_DISK_INDEX_HPP
+#define _HNSW_DISK_INDEX_HPP
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "HNSW.hpp"
+
+namespace ANN {
+
+// Batched reads through io_uring, set up with the raw syscalls. Falls back to
+// pread when the kernel (or a seccomp policy) does not allow io_uring
+class io_ring {
+public:
+    struct request {
+        void *buf;
+        uint32_t size;
+        uint64_t off;
+    };
+
+    explicit io_ring(uint32_t depth = 64) {
+        io_uring_params p{};
+        fd_ring = syscall(__NR_io_uring_setup, depth, &p);
+        if (fd_ring < 0) return;
+
+        size_sq = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+        size_cq = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            size_sq = size_cq = std::max(size_sq, size_cq);
+        ptr_sq = mmap(nullptr, size_sq, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd_ring, IORING_OFF_SQ_RING);
+        ptr_cq = (p.features & IORING_FEAT_SINGLE_MMAP)
+                 ? ptr_sq
+                 : mmap(nullptr, size_cq, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd_ring, IORING_OFF_CQ_RING);
+        size_sqes = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe *)mmap(nullptr, size_sqes, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, fd_ring, IORING_OFF_SQES);
+        if (ptr_sq == MAP_FAILED || ptr_cq == MAP_FAILED || sqes == MAP_FAILED) {
+            release();
+            return;
+        }
+
+        auto *sq = (char *)ptr_sq, *cq = (char *)ptr_cq;
+        sq_tail = (uint32_t *)(sq + p.sq_off.tail);
+        sq_mask = *(uint32_t *)(sq + p.sq_off.ring_mask);
+        sq_array = (uint32_t *)(sq + p.sq_off.array);
+        cq_head = (uint32_t *)(cq + p.cq_off.head);
+        cq_tail = (uint32_t *)(cq + p.cq_off.tail);
+        cq_mask = *(uint32_t *)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+        this->depth = p.sq_entries;
+    }
+
+    io_ring(const io_ring &) = delete;
+    io_ring &operator=(const io_ring &) = delete;
+
+    ~io_ring() {
+        release();
+    }
+
+    bool available() const {
+        return fd_ring >= 0;
+    }
+
+    // issue all the reads at once and wait for them to complete. A failed
+    // read throws only once the whole batch is reaped, as the kernel writes
+    // into the buffers of the reads still in flight
+    void read(int fd, const request *req, size_t cnt) {
+        if (!available()) {
+            for (size_t i = 0; i < cnt; ++i) read_sync(fd, req[i], 0);
+            return;
+        }
+        for (size_t begin = 0; begin < cnt; begin += depth) {
+            const uint32_t size_batch = std::min<size_t>(depth, cnt - begin);
+            uint32_t tail = *sq_tail;
+            for (uint32_t i = 0; i < size_batch; ++i) {
+                const auto &r = req[begin + i];
+                const uint32_t idx = tail & sq_mask;
+                io_uring_sqe &sqe = sqes[idx];
+                memset(&sqe, 0, sizeof(sqe));
+                sqe.opcode = IORING_OP_READ;
+                sqe.fd = fd;
+                sqe.addr = (uint64_t)r.buf;
+                sqe.len = r.size;
+                sqe.off = r.off;
+                sqe.user_data = begin + i;
+                sq_array[idx] = idx;
+                tail++;
+            }
+            __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+            uint32_t cnt_done = 0, to_submit = size_batch;
+            bool failed = false;
+            while (cnt_done < size_batch) {
+                const int ret = syscall(__NR_io_uring_enter, fd_ring, to_submit, 1,
+                                        IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (ret < 0) {
+                    if (errno == EINTR) continue;
+                    // the state of the batch is unknown; tearing the ring
+                    // down cancels what is in flight, and pread takes over
+                    release();
+                    throw std::runtime_error("io_uring_enter failed");
+                }
+                to_submit -= std::min<uint32_t>(ret, to_submit);
+
+                uint32_t head = __atomic_load_n(cq_head, __ATOMIC_RELAXED);
+                const uint32_t tail_cq = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+                for (; head != tail_cq; ++head, ++cnt_done) {
+                    const io_uring_cqe &cqe = cqes[head & cq_mask];
+                    const auto &r = req[cqe.user_data];
+                    if (cqe.res < 0) {
+                        failed = true;
+                        continue;
+                    }
+                    // finish a short read synchronously
+                    if (!failed && uint32_t(cqe.res) < r.size) {
+                        try {
+                            read_sync(fd, r, cqe.res);
+                        } catch (const std::runtime_error &) {
+                            failed = true;
+                        }
+                    }
+                }
+                __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            }
+            if (failed) throw std::runtime_error("Failed to read the disk index");
+        }
+    }
+
+private:
+    // With O_DIRECT the buffer, offset and size of a read have to stay
+    // aligned, so a short read resumes from the start of the block it ended in
+    static void read_sync(int fd, const request &r, uint32_t done) {
+        done = done / size_align * size_align;
+        while (done < r.size) {
+            const ssize_t cnt = pread(fd, (char *)r.buf + done, r.size - done, r.off + done);
+            if (cnt == -1 && errno == EINTR) continue;
+            const uint32_t next = cnt > 0 && done + cnt < r.size
+                                  ? (done + cnt) / size_align * size_align
+                                  : done + std::max<ssize_t>(cnt, 0);
+            if (next == done) throw std::runtime_error("Failed to read the disk index");
+            done = next;
+        }
+    }
+
+    static constexpr uint32_t size_align = 4096;
+
+    void release() {
+        if (sqes && sqes != MAP_FAILED) munmap(sqes, size_sqes);
+        if (ptr_cq && ptr_cq != MAP_FAILED && ptr_cq != ptr_sq) munmap(ptr_cq, size_cq);
+        if (ptr_sq && ptr_sq != MAP_FAILED) munmap(ptr_sq, size_sq);
+        if (fd_ring >= 0) close(fd_ring);
+        fd_ring = -1;
+    }
+
+    int fd_ring = -1;
+    uint32_t depth = 0;
+    void *ptr_sq = nullptr, *ptr_cq = nullptr;
+    size_t size_sq = 0, size_cq = 0, size_sqes = 0;
+    io_uring_sqe *sqes = nullptr;
+    io_uring_cqe *cqes = nullptr;
+    uint32_t *sq_tail, *sq_array, *cq_head, *cq_tail;
+    uint32_t sq_mask, cq_mask;
+};
+
+// Hybrid index: the upper layers and compressed vectors stay in memory, while
+// the level-0 adjacency and the full vectors live on disk in 4 KB-aligned
+// node blocks. The search descends the upper layers in memory, then runs a
+// beam search on level 0 whose every round reads the blocks of the closest
+// unexpanded nodes with one batch of asynchronous reads
+template <typename U>
+class HNSW_disk {
+    using T = typename U::type_point;
+    using type_elem = typename U::type_elem;
+    typedef typename id_of<U>::type node_id;
+    static_assert(std::is_constructible_v<T, node_id, const type_elem *>);
+
+    // SQ8 for the floating-point vectors; the others are kept as they are
+    static constexpr bool quantized = std::is_floating_point_v<type_elem>;
+    using type_code = std::conditional_t<quantized, uint8_t, type_elem>;
+    static constexpr uint64_t size_block = 4096;
+
+    struct header {
+        char model_type[8];
+        uint32_t version;
+        uint32_t dim;
+        float m_l;
+        uint32_t m;
+        uint32_t ef_construction;
+        float alpha;
+        uint32_t n;
+        uint32_t degree_max;  // of level 0
+        uint32_t size_elem;
+        uint32_t size_code;
+        uint64_t size_record;      // vector, degree and neighbors of a node
+        uint64_t nodes_per_block;  // 0 if a node spans several blocks
+        uint64_t blocks_per_node;
+        // the upper layers, with the lists of levels 1..level of every node
+        uint64_t cnt_list;
+        uint64_t cnt_edge;
+        uint64_t size_entrance;
+        uint64_t off_id;            // node_id[n]
+        uint64_t off_level;         // uint32_t[n]
+        uint64_t off_offset_level;  // uint64_t[n+1]
+        uint64_t off_offset_adj;    // uint64_t[cnt_list+1]
+        uint64_t off_adj;           // node_id[cnt_edge]
+        uint64_t off_entrance;      // node_id[size_entrance]
+        uint64_t off_quant_param;   // float min[dim], float scale[dim]
+        uint64_t off_code;          // type_code[n*dim]
+        uint64_t off_block;         // the level-0 node blocks
+        uint64_t size_file;
+        uint32_t size_id;           // bytes per node or point id; 4 if zero
+        uint64_t cnt_node;          // n in full, as `n` above has 32 bits
+    };
+
+public:
+    // Write `index` in the disk layout
+    template <template <typename> class Allocator>
+    static void save(const HNSW<U, Allocator> &index, const std::string &filename);
+
+    explicit HNSW_disk(const std::string &filename, bool direct_io = true);
+
+    HNSW_disk(const HNSW_disk &) = delete;
+    HNSW_disk &operator=(const HNSW_disk &) = delete;
+
+    ~HNSW_disk() {
+        if (fd != -1) close(fd);
+    }
+
+    struct search_stat {
+        uint32_t cnt_round = 0;  // rounds of I/O
+        uint32_t cnt_read = 0;   // node records read
+    };
+
+    // `beam_width` nodes are expanded (and read) per round
+    parlay::sequence<std::pair<node_id, float>> search(
+                const T &q, uint32_t k, uint32_t ef, uint32_t beam_width = 4,
+                search_stat *stat = nullptr) const;
+
+    bool uses_io_uring() const {
+        return get_ring().available();
+    }
+
+    uint32_t dim;
+    node_id n;
+
+private:
+    template <class F>
+    static void encode(uint32_t dim, size_t n, F coord, const float *quant_param,
+                       type_code *code);
+
+    float distance_approx(const T &q, node_id pu) const;
+    static io_ring &get_ring();
+
+    header h;
+    int fd = -1;
+    parlay::sequence<node_id> id;
+    parlay::sequence<uint32_t> level;
+    parlay::sequence<uint64_t> offset_level, offset_adj;
+    parlay::sequence<node_id> adj, entrance;
+    parlay::sequence<float> quant_param;
+    parlay::sequence<type_code> code;
+};
+
+template <typename U>
+template <class F>
+void HNSW_disk<U>::encode(uint32_t dim, size_t n, F coord, const float *quant_param,
+                          type_code *code) {
+    parlay::parallel_for(0, n, [&](size_t i) {
+        const type_elem *v = coord(i);
+        for (uint32_t j = 0; j < dim; ++j) {
+            if constexpr (quantized) {
+                const float scale = quant_param[dim + j];
+                const float c = scale > 0 ? std::round((v[j] - quant_param[j]) / scale) : 0;
+                code[i * dim + j] = uint8_t(std::clamp(c, 0.f, 255.f));
+            } else {
+                code[i * dim + j] = v[j];
+            }
+        }
+    });
+}
+
+template <typename U>
+template <template <typename> class Allocator>
+void HNSW_disk<U>::save(const HNSW<U, Allocator> &index, const std::string &filename) {
+    using HNSW_t = HNSW<U, Allocator>;
+    const size_t n = index.n;
+    const uint32_t dim = index.dim;
+    auto coord = [&](size_t i) -> const type_elem * {
+        return index.point_of(i)->coord;
+    };
+
+    header h{};
+    memcpy(h.model_type, "HNSWDISK", 8);
+    h.version = 1;
+    h.dim = dim;
+    h.m_l = index.m_l;
+    h.m = index.m;
+    h.ef_construction = index.ef_construction;
+    h.alpha = index.alpha;
+    h.n = uint32_t(n);
+    h.size_id = sizeof(node_id);
+    h.cnt_node = n;
+    h.degree_max = index.get_degree_max(0);
+    h.size_elem = sizeof(type_elem);
+    h.size_code = sizeof(type_code);
+    h.size_record = dim * sizeof(type_elem) + sizeof(uint32_t) +
+                    h.degree_max * sizeof(node_id);
+    h.nodes_per_block = size_block / h.size_record;
+    h.blocks_per_node =
+        h.nodes_per_block ? 1 : (h.size_record + size_block - 1) / size_block;
+
+    // the upper layers as flat arrays
+    auto level = parlay::tabulate(n, [&](size_t i) {
+        return index.level_of(i);
+    });
+    auto id = parlay::tabulate(n, [&](size_t i) {
+        return node_id(U::get_id(index.point_of(i)));
+    });
+    parlay::sequence<uint64_t> offset_level(n + 1);
+    parlay::parallel_for(0, n, [&](size_t i) {
+        offset_level[i] = level[i];
+    });
+    offset_level[n] = 0;
+    h.cnt_list = parlay::scan_inplace(offset_level.cut(0, n));
+    offset_level[n] = h.cnt_list;
+    parlay::sequence<uint64_t> offset_adj(h.cnt_list + 1);
+    parlay::parallel_for(0, n, [&](node_id pu) {
+        for (uint32_t l = 1; l <= level[pu]; ++l)
+            offset_adj[offset_level[pu] + l - 1] = index.neighbourhood_view(pu, l).size();
+    });
+    offset_adj[h.cnt_list] = 0;
+    h.cnt_edge = parlay::scan_inplace(offset_adj.cut(0, h.cnt_list));
+    offset_adj[h.cnt_list] = h.cnt_edge;
+    auto adj = parlay::sequence<node_id>::uninitialized(h.cnt_edge);
+    parlay::parallel_for(0, n, [&](node_id pu) {
+        for (uint32_t l = 1; l <= level[pu]; ++l) {
+            const auto nbh = index.neighbourhood_view(pu, l);
+            std::copy(nbh.begin(), nbh.end(), &adj[offset_adj[offset_level[pu] + l - 1]]);
+        }
+    });
+    h.size_entrance = index.entrance.size();
+
+    // the compressed vectors
+    parlay::sequence<float> quant_param(dim * 2);
+    if constexpr (quantized) {
+        quant_param = parlay::tabulate(dim * 2, [&](size_t j) {
+            const auto v = parlay::delayed_seq<float>(n, [&](size_t i) {
+                return float(coord(i)[j % dim]);
+            });
+            return j < dim ? parlay::reduce(v, parlay::minm<float>())
+                   : parlay::reduce(v, parlay::maxm<float>());
+        });
+        for (uint32_t j = 0; j < dim; ++j)  // max -> scale
+            quant_param[dim + j] = (quant_param[dim + j] - quant_param[j]) / 255;
+    }
+    auto code = parlay::sequence<type_code>::uninitialized(size_t(n) * dim);
+    encode(dim, n, coord, quant_param.data(), code.data());
+
+    uint64_t size_file = sizeof(header);
+    auto place = [&](uint64_t size) {
+        const uint64_t off = (size_file + size_block - 1) / size_block * size_block;
+        size_file = off + size;
+        return off;
+    };
+    h.off_id = place(n * sizeof(node_id));
+    h.off_level = place(n * sizeof(uint32_t));
+    h.off_offset_level = place((n + 1) * sizeof(uint64_t));
+    h.off_offset_adj = place((h.cnt_list + 1) * sizeof(uint64_t));
+    h.off_adj = place(h.cnt_edge * sizeof(node_id));
+    h.off_entrance = place(h.size_entrance * sizeof(node_id));
+    h.off_quant_param = place(dim * 2 * sizeof(float));
+    h.off_code = place(code.size() * sizeof(type_code));
+    const uint64_t cnt_block = h.nodes_per_block
+                               ? (n + h.nodes_per_block - 1) / h.nodes_per_block
+                               : n * h.blocks_per_node;
+    h.off_block = place(cnt_block * size_block);
+    h.size_file = size_file;
+
+    const int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) throw std::runtime_error("Failed to create the disk index");
+    std::unique_ptr<int, void (*)(int *)> guard_fd(new int(fd), [](int *fd) {
+        close(*fd);
+        delete fd;
+    });
+    if (ftruncate(fd, size_file) == -1)
+        throw std::runtime_error("Failed to create the disk index");
+    HNSW_t::write_parallel(fd, (const char *)&h, sizeof(h), 0);
+    auto write = [&](uint64_t off, const auto &seq) {
+        HNSW_t::write_parallel(fd, (const char *)seq.data(),
+                               seq.size() * sizeof(seq[0]), off);
+    };
+    write(h.off_id, id);
+    write(h.off_level, level);
+    write(h.off_offset_level, offset_level);
+    write(h.off_offset_adj, offset_adj);
+    write(h.off_adj, adj);
+    write(h.off_entrance, parlay::to_sequence(index.entrance.view()));
+    write(h.off_quant_param, quant_param);
+    write(h.off_code, code);
+
+    // the node blocks, a range of them per worker; the records are packed
+    // into the blocks without straddling two of them
+    const size_t nodes_per_chunk = h.nodes_per_block ? h.nodes_per_block * 256 : 64;
+    parlay::parallel_for(0, (n + nodes_per_chunk - 1) / nodes_per_chunk, [&](size_t c) {
+        const size_t node_begin = c * nodes_per_chunk;
+        const size_t node_end = std::min<size_t>(node_begin + nodes_per_chunk, n);
+        auto offset = [&](size_t i) -> uint64_t {
+            if (!h.nodes_per_block) return i * h.blocks_per_node * size_block;
+            return i / h.nodes_per_block * size_block + i % h.nodes_per_block * h.size_record;
+        };
+        const uint64_t off_begin = offset(node_begin);
+        parlay::sequence<char> buf(
+            (offset(node_end - 1) - off_begin) / size_block * size_block +
+            (h.nodes_per_block ? 1 : h.blocks_per_node) * size_block, 0);
+        for (size_t i = node_begin; i < node_end; ++i) {
+            char *p = &buf[offset(i) - off_begin];
+            memcpy(p, coord(i), dim * sizeof(type_elem));
+            p += dim * sizeof(type_elem);
+            const auto nbh = index.neighbourhood_view(i, 0);
+            const uint32_t degree = nbh.size();
+            memcpy(p, &degree, sizeof(degree));
+            memcpy(p + sizeof(degree), nbh.begin(), degree * sizeof(node_id));
+        }
+        HNSW_t::write_parallel(fd, buf.data(), buf.size(), h.off_block + off_begin);
+    }, 1);
+}
+
+template <typename U>
+HNSW_disk<U>::HNSW_disk(const std::string &filename, bool direct_io) {
+    using HNSW_t = HNSW<U>;
+    // the in-memory part is read through a buffered descriptor
+    const int fd_mem = open(filename.c_str(), O_RDONLY);
+    if (fd_mem == -1) throw std::runtime_error("Failed to open the disk index");
+    std::unique_ptr<int, void (*)(int *)> guard_fd(new int(fd_mem), [](int *fd) {
+        close(*fd);
+        delete fd;
+    });
+    struct stat sb;
+    if (fstat(fd_mem, &sb) == -1 || size_t(sb.st_size) < sizeof(h))
+        throw std::runtime_error("Truncated disk index");
+    HNSW_t::read_parallel(fd_mem, (char *)&h, sizeof(h), 0);
+    if (memcmp(h.model_type, "HNSWDISK", 8) || h.version != 1)
+        throw std::runtime_error("Wrong type of disk index");
+    if (h.size_file != size_t(sb.st_size)) throw std::runtime_error("Truncated disk index");
+    if (h.size_elem != sizeof(type_elem) || h.size_code != sizeof(type_code))
+        throw std::runtime_error("The disk index has a different vector type");
+    if ((h.size_id ? h.size_id : sizeof(uint32_t)) != sizeof(node_id))
+        throw std::runtime_error("The disk index has ids of a different width");
+    dim = h.dim;
+    n = h.size_id ? h.cnt_node : h.n;
+
+    auto read = [&](uint64_t off, auto &seq, size_t size) {
+        using V = typename std::remove_reference_t<decltype(seq)>::value_type;
+        seq = parlay::sequence<V>::uninitialized(size);
+        HNSW_t::read_parallel(fd_mem, (char *)seq.data(), size * sizeof(V), off);
+    };
+    read(h.off_id, id, n);
+    read(h.off_level, level, n);
+    read(h.off_offset_level, offset_level, n + 1);
+    read(h.off_offset_adj, offset_adj, h.cnt_list + 1);
+    read(h.off_adj, adj, h.cnt_edge);
+    read(h.off_entrance, entrance, h.size_entrance);
+    read(h.off_quant_param, quant_param, dim * 2);
+    read(h.off_code, code, size_t(n) * dim);
+
+    // the node blocks are read with O_DIRECT when the file system allows it;
+    // opened last, as nothing closes it if the constructor throws
+    if (direct_io) fd = open(filename.c_str(), O_RDONLY | O_DIRECT);
+    if (fd == -1) fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1) throw std::runtime_error("Failed to open the disk index");
+
+    spdlog::info("Disk index: n={} dim={} in memory {} MB, node record {} B, "
+                 "{} nodes per block", n, dim,
+                 (code.size() * sizeof(type_code) + adj.size() * sizeof(node_id)) >> 20,
+                 h.size_record, h.nodes_per_block);
+}
+
+template <typename U>
+io_ring &HNSW_disk<U>::get_ring() {
+    // every thread sets up its own ring on first use, also the ones outside
+    // the parlay pool, which all have worker id 0; the rings take the fd with
+    // each read, so the disk indexes share them
+    thread_local io_ring ring;
+    return ring;
+}
+
+template <typename U>
+float HNSW_disk<U>::distance_approx(const T &q, node_id pu) const {
+    const type_code *c = &code[size_t(pu) * dim];
+    if constexpr (quantized) {
+        thread_local std::vector<type_elem> v;
+        v.resize(dim);
+        for (uint32_t j = 0; j < dim; ++j)
+            v[j] = quant_param[j] + quant_param[dim + j] * c[j];
+        return U::distance(q, T(pu, v.data()), dim);
+    } else {
+        return U::distance(q, T(pu, c), dim);
+    }
+}
+
+template <typename U>
+auto HNSW_disk<U>::search(const T &q, uint32_t k, uint32_t ef, uint32_t beam_width,
+                          search_stat *stat) const
+-> parlay::sequence<std::pair<node_id, float>> {
+    if (n == 0) return {};
+    ef = std::max(ef, k);
+    beam_width = std::max(beam_width, 1u);
+
+    // 1. Greedy descent on the upper layers in memory
+    node_id pu = entrance[0];
+    float d_u = distance_approx(q, pu);
+    for (uint32_t l = level[pu]; l > 0; --l) {
+        for (bool changed = true; changed;) {
+            changed = false;
+            const uint64_t idx = offset_level[pu] + l - 1;
+            for (uint64_t e = offset_adj[idx]; e < offset_adj[idx + 1]; ++e) {
+                const node_id pv = adj[e];
+                const float d_v = distance_approx(q, pv);
+                if (d_v < d_u) {
+                    pu = pv;
+                    d_u = d_v;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // 2. Beam search on level 0: the frontier is ranked by the compressed
+    // vectors, and the nodes read from disk are re-ranked by the full ones
+    struct cand {
+        float d;
+        node_id u;
+        bool expanded;
+    };
+    auto less = [](const cand &a, const cand &b) {
+        return a.d < b.d || (a.d == b.d && a.u < b.u);
+    };
+    std::vector<cand> frontier{{d_u, pu, false}};
+    std::unordered_set<node_id> seen{pu};
+    std::vector<std::pair<float, node_id>> res;
+
+    const uint64_t size_read =
+        (h.nodes_per_block ? 1 : h.blocks_per_node) * size_block;
+    std::unique_ptr<char, decltype(&std::free)> buf(
+        (char *)std::aligned_alloc(size_block, beam_width * size_read), std::free);
+    std::vector<io_ring::request> req;
+    std::vector<node_id> node_read;
+    auto &ring = get_ring();
+
+    while (true) {
+        node_read.clear();
+        req.clear();
+        for (auto &c : frontier) {
+            if (c.expanded) continue;
+            c.expanded = true;
+            const uint64_t block = h.nodes_per_block ? c.u / h.nodes_per_block
+                                   : c.u * h.blocks_per_node;
+            req.push_back({buf.get() + node_read.size() * size_read, uint32_t(size_read),
+                           h.off_block + block * size_block});
+            node_read.push_back(c.u);
+            if (node_read.size() == beam_width) break;
+        }
+        if (node_read.empty()) break;
+        ring.read(fd, req.data(), req.size());
+        if (stat) {
+            stat->cnt_round++;
+            stat->cnt_read += node_read.size();
+        }
+
+        for (size_t i = 0; i < node_read.size(); ++i) {
+            const node_id pv = node_read[i];
+            const char *p = buf.get() + i * size_read;
+            if (h.nodes_per_block) p += pv % h.nodes_per_block * h.size_record;
+            res.push_back({U::distance(q, T(pv, (const type_elem *)p), dim), pv});
+
+            uint32_t degree;
+            memcpy(&degree, p + dim * sizeof(type_elem), sizeof(degree));
+            const auto *nbh = (const node_id *)(p + dim * sizeof(type_elem) + sizeof(degree));
+            for (uint32_t j = 0; j < degree; ++j) {
+                node_id pw;
+                memcpy(&pw, nbh + j, sizeof(pw));
+                if (!seen.insert(pw).second) continue;
+                const cand c{distance_approx(q, pw), pw, false};
+                if (frontier.size() >= ef && !less(c, frontier.back())) continue;
+                frontier.insert(std::upper_bound(frontier.begin(), frontier.end(), c, less), c);
+                if (frontier.size() > ef) frontier.pop_back();
+            }
+        }
+    }
+
+    std::sort(res.begin(), res.end());
+    if (res.size() > k) res.resize(k);
+    return parlay::tabulate(res.size(), [&](size_t i) {
+        return std::pair<node_id, float>{id[res[i].second], res[i].first};
+    });
+}
+
+}  // namespace ANN
+
+#endif  // _HNSW_DISK_INDEX_HPP
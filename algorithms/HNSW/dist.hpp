@@ -7,7 +7,7 @@
 #include "type_point.hpp"
 #include <spdlog/spdlog.h>
 
-template <typename T>
+template <typename T, typename Id = uint32_t>
 class descr_ang {
     using promoted_type =
         std::conditional_t<std::is_integral_v<T> && sizeof(T) <= 4,
@@ -16,7 +16,8 @@ class descr_ang {
 
 public:
     typedef T type_elem;
-    typedef point<T> type_point;
+    typedef Id type_id;
+    typedef point<T, Id> type_point;
     static float distance(const type_point &u, const type_point &v,
                           uint32_t dim) {
         const auto *uc = u.coord, *vc = v.coord;
@@ -34,7 +35,7 @@ public:
     }
 };
 
-template <typename T>
+template <typename T, typename Id = uint32_t>
 class descr_ndot {
     using promoted_type =
         std::conditional_t<std::is_integral_v<T> && sizeof(T) <= 4,
@@ -43,7 +44,8 @@ class descr_ndot {
 
 public:
     typedef T type_elem;
-    typedef point<T> type_point;
+    typedef Id type_id;
+    typedef point<T, Id> type_point;
     static float distance(const type_point &u, const type_point &v,
                           uint32_t dim) {
         const auto *uc = u.coord, *vc = v.coord;
@@ -57,7 +59,7 @@ public:
     }
 };
 
-template <typename T>
+template <typename T, typename Id = uint32_t>
 class descr_l2 {
     using promoted_type =
         std::conditional_t<std::is_integral_v<T> && sizeof(T) <= 4,
@@ -66,7 +68,8 @@ class descr_l2 {
 
 public:
     typedef T type_elem;
-    typedef point<T> type_point;
+    typedef Id type_id;
+    typedef point<T, Id> type_point;
     static float distance(const type_point &u, const type_point &v,
                           uint32_t dim) {
         if constexpr (std::is_integral_v<T>) {
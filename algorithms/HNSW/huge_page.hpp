@@ -0,0 +1,422 @@
+#ifndef _HNSW_HUGE_PAGE_HPP
+#define _HNSW_HUGE_PAGE_HPP
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+namespace ANN {
+
+// how the memory of the indexes is backed: regular pages, transparent huge
+// pages (madvise), or the huge pages reserved for hugetlbfs (vm.nr_hugepages),
+// which fall back to transparent ones once the reserve runs out
+enum class huge_page_mode { NONE, TRANSPARENT, EXPLICIT };
+
+struct huge_page_report {
+    huge_page_mode mode = huge_page_mode::NONE;
+    size_t bytes_mapped = 0;    // the chunks and large regions of the pool
+    size_t bytes_resident = 0;  // of which are in memory
+    size_t bytes_huge = 0;      // of which are on huge pages of either kind
+    size_t bytes_hugetlb = 0;   // of which are on explicit ones
+    size_t cnt_fallback = 0;    // explicit mappings that got transparent pages
+
+    // the share of the resident memory on huge pages
+    double coverage() const {
+        return bytes_resident ? double(bytes_huge) / bytes_resident : 0;
+    }
+};
+
+// The memory of the nodes, the adjacency lists, the vectors and the search
+// buffers. With huge pages, a large request gets a mapping of its own, while
+// the small ones are carved out of huge chunks by size class and recycled
+// through per-thread caches, so that the pages a search walks over are huge
+// too. Without, requests go to malloc. The mode is set once, before the
+// first allocation, as the blocks are freed according to it
+class huge_page_pool {
+    struct header {  // right before what is handed out on huge pages
+        uint64_t size_region;  // of a large one, which is its own mapping
+        uint32_t cls;
+        uint32_t reserved;
+    };
+
+    static constexpr size_t size_header = sizeof(header);
+    // before the blocks of 4 KB and more, which are kept cache-aligned
+    static constexpr size_t size_header_large = 64;
+    // classes are 16 bytes apart up to 4 KB, then powers of 2 up to 1 MB
+    static constexpr size_t size_small_max = 4096;
+    static constexpr size_t size_block_max = 1 << 20;
+    static constexpr uint32_t cnt_class_small = size_small_max / 16;
+    static constexpr uint32_t cnt_class = cnt_class_small + 8;
+    static constexpr uint32_t class_large = cnt_class;
+    static constexpr size_t size_batch = 64 << 10;  // moved to and from a cache
+    static constexpr size_t size_chunk = 32 << 20;
+
+    struct free_list {
+        std::mutex mutex;
+        void *head = nullptr;
+    };
+
+    struct cache {
+        void *head[cnt_class] = {};
+        size_t size[cnt_class] = {};  // in bytes
+
+        // hand the blocks of an exiting thread back to the pool
+        ~cache() {
+            cache_gone() = true;
+            for (uint32_t cls = 0; cls < cnt_class; ++cls) {
+                if (head[cls]) global().give_back(cls, head[cls]);
+            }
+        }
+    };
+
+public:
+    static constexpr size_t size_huge = 1 << 21;
+
+    static huge_page_pool &global() {
+        static huge_page_pool pool;
+        return pool;
+    }
+
+    void configure(huge_page_mode m) {
+        if (m == mode()) return;
+        if (used.load(std::memory_order_relaxed))
+            throw std::runtime_error("The huge page mode has to be set before allocating");
+        mode_.store(m, std::memory_order_relaxed);
+        if (m == huge_page_mode::NONE) return;
+
+        std::ifstream thp("/sys/kernel/mm/transparent_hugepage/enabled");
+        std::string setting;
+        std::getline(thp, setting);
+        if (setting.find("[never]") != std::string::npos)
+            spdlog::warn("Transparent huge pages are disabled on this system");
+        spdlog::info("Backing the indexes with {} huge pages",
+                     m == huge_page_mode::EXPLICIT ? "explicit" : "transparent");
+    }
+
+    huge_page_mode mode() const {
+        return mode_.load(std::memory_order_relaxed);
+    }
+
+    // Blocks of about 4 KB and more are aligned to cache lines, the others to
+    // 16 bytes
+    void *allocate(size_t size) {
+        if (!used.load(std::memory_order_relaxed))
+            used.store(true, std::memory_order_relaxed);
+        const bool is_small = size + size_header <= size_small_max;
+        if (mode() == huge_page_mode::NONE) {
+            void *p = is_small ? std::malloc(std::max<size_t>(size, 1))
+                      : std::aligned_alloc(64, (size + 63) / 64 * 64);
+            if (!p) throw std::bad_alloc();
+            return p;
+        }
+        const size_t offset = is_small ? size_header : size_header_large;
+        if (size + offset > size_block_max) return allocate_large(size);
+
+        const uint32_t cls = class_of(size + offset);
+        cache *c = local_cache();
+        // past the cache of the thread, a batch is taken for this block alone
+        // and the rest goes back right away
+        std::optional<cache> spare;
+        if (!c) c = &spare.emplace();
+        if (!c->head[cls]) refill(*c, cls);
+        char *b = static_cast<char *>(c->head[cls]);
+        c->head[cls] = next_of(b);
+        c->size[cls] -= size_of_class(cls);
+        reinterpret_cast<header *>(b + offset - size_header)->cls = cls;
+        return b + offset;
+    }
+
+    // usable as the deleter of whatever allocate() returns
+    static void deallocate(void *p) {
+        if (!p) return;
+        huge_page_pool &pool = global();
+        if (pool.mode() == huge_page_mode::NONE) return std::free(p);
+
+        auto *h = reinterpret_cast<header *>(static_cast<char *>(p) - size_header);
+        if (h->cls == class_large) return pool.deallocate_large(p, h->size_region);
+        const uint32_t cls = h->cls;
+        void *b = static_cast<char *>(p) - offset_of(cls);
+        cache *c = local_cache();
+        if (!c) {
+            next_of(b) = nullptr;
+            return pool.give_back(cls, b);
+        }
+        next_of(b) = c->head[cls];
+        c->head[cls] = b;
+        c->size[cls] += size_of_class(cls);
+        if (c->size[cls] > 2 * size_batch_of(cls)) pool.spill(*c, cls);
+    }
+
+    // How much of the memory of the pool is on huge pages, as accounted by the
+    // kernel in /proc/self/smaps. A mapping that the kernel merged with its
+    // neighbors is counted in proportion to the part the pool holds
+    huge_page_report report() const {
+        huge_page_report res;
+        res.mode = mode();
+        std::vector<std::pair<uintptr_t, uintptr_t>> list_range;
+        {
+            std::lock_guard<std::mutex> lock(mutex_region);
+            for (const auto &[begin, size] : list_region) {
+                list_range.emplace_back(begin, begin + size);
+                res.bytes_mapped += size;
+            }
+            res.cnt_fallback = cnt_fallback;
+        }
+        if (list_range.empty()) return res;
+
+        std::ifstream smaps("/proc/self/smaps");
+        if (!smaps) {
+            spdlog::warn("Failed to read /proc/self/smaps");
+            return res;
+        }
+        double share = 0;  // of the current mapping that is in the pool
+        double resident = 0, huge = 0, hugetlb = 0;
+        for (std::string line; std::getline(smaps, line);) {
+            unsigned long begin, end;
+            if (sscanf(line.c_str(), "%lx-%lx ", &begin, &end) == 2) {
+                size_t overlap = 0;
+                for (const auto &[b, e] : list_range) {
+                    if (b < end && begin < e)
+                        overlap += std::min<uintptr_t>(e, end) - std::max<uintptr_t>(b, begin);
+                }
+                share = double(overlap) / (end - begin);
+                continue;
+            }
+            char key[64];
+            size_t kb;
+            if (share == 0 || sscanf(line.c_str(), "%63[^:]: %zu kB", key, &kb) != 2)
+                continue;
+            const std::string field = key;
+            const double bytes = share * kb * 1024;
+            if (field == "Rss") resident += bytes;
+            else if (field == "AnonHugePages") huge += bytes;
+            // not part of Rss
+            else if (field == "Private_Hugetlb" || field == "Shared_Hugetlb") hugetlb += bytes;
+        }
+        res.bytes_hugetlb = hugetlb;
+        res.bytes_huge = huge + hugetlb;
+        res.bytes_resident = resident + hugetlb;
+        return res;
+    }
+
+private:
+    huge_page_pool() = default;
+
+    // Null once the cache of the thread is destroyed, as the thread_locals
+    // destroyed after it may still hold index memory, e.g., a container
+    // constructed before the first allocation of the thread
+    static cache *local_cache() {
+        static thread_local cache c;
+        return cache_gone() ? nullptr : &c;
+    }
+
+    // trivially destructible, so still readable after `c` above is gone
+    static bool &cache_gone() {
+        static thread_local bool gone = false;
+        return gone;
+    }
+
+    static void *&next_of(void *b) {
+        return *static_cast<void **>(b);
+    }
+
+    static size_t offset_of(uint32_t cls) {
+        return cls < cnt_class_small ? size_header : size_header_large;
+    }
+
+    // `size` includes the header
+    static uint32_t class_of(size_t size) {
+        if (size <= size_small_max) return (size + 15) / 16 - 1;
+        const uint32_t bits = 64 - __builtin_clzll(size - 1);
+        return cnt_class_small + bits - 13;
+    }
+
+    static size_t size_of_class(uint32_t cls) {
+        if (cls < cnt_class_small) return (cls + 1) * 16;
+        return size_t(1) << (cls - cnt_class_small + 13);
+    }
+
+    static size_t size_batch_of(uint32_t cls) {
+        return std::max(size_batch, size_of_class(cls));
+    }
+
+    // Map `size` bytes (a multiple of the huge page) aligned to a huge page
+    void *map(size_t size) {
+        void *p = MAP_FAILED;
+        if (mode() == huge_page_mode::EXPLICIT) {
+            p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (p == MAP_FAILED) {
+                std::lock_guard<std::mutex> lock(mutex_region);
+                if (cnt_fallback++ == 0)
+                    spdlog::warn("Ran out of explicit huge pages; using transparent ones");
+            }
+        }
+        if (p == MAP_FAILED) {
+            // over-map to trim it to the alignment THP needs
+            char *q = static_cast<char *>(mmap(nullptr, size + size_huge,
+                                               PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+            if (q == MAP_FAILED) throw std::bad_alloc();
+            char *r = reinterpret_cast<char *>(
+                          (reinterpret_cast<uintptr_t>(q) + size_huge - 1) & ~(size_huge - 1));
+            if (r != q) munmap(q, r - q);
+            if (r + size != q + size + size_huge)
+                munmap(r + size, q + size_huge - r);
+            madvise(r, size, MADV_HUGEPAGE);  // in vain if THP is disabled
+            p = r;
+        }
+        std::lock_guard<std::mutex> lock(mutex_region);
+        list_region.emplace(reinterpret_cast<uintptr_t>(p), size);
+        return p;
+    }
+
+    void *allocate_large(size_t size) {
+        const size_t size_region =
+            (size + size_header_large + size_huge - 1) / size_huge * size_huge;
+        char *r = static_cast<char *>(map(size_region));
+        char *p = r + size_header_large;
+        auto *h = reinterpret_cast<header *>(p - size_header);
+        h->size_region = size_region;
+        h->cls = class_large;
+        return p;
+    }
+
+    void deallocate_large(void *p, size_t size_region) {
+        char *r = static_cast<char *>(p) - size_header_large;
+        {
+            std::lock_guard<std::mutex> lock(mutex_region);
+            list_region.erase(reinterpret_cast<uintptr_t>(r));
+        }
+        munmap(r, size_region);
+    }
+
+    // Take a batch of blocks from the shared list of the class, or carve a
+    // new one out of the current chunk
+    void refill(cache &c, uint32_t cls) {
+        const size_t size_block = size_of_class(cls);
+        const size_t size_want = size_batch_of(cls);
+        {
+            free_list &list = list_free[cls];
+            std::lock_guard<std::mutex> lock(list.mutex);
+            void *b = list.head;
+            for (size_t size = 0; b && size < size_want; size += size_block) {
+                void *next = next_of(b);
+                next_of(b) = c.head[cls];
+                c.head[cls] = b;
+                c.size[cls] += size_block;
+                b = next;
+            }
+            list.head = b;
+        }
+        if (c.head[cls]) return;
+
+        std::lock_guard<std::mutex> lock(mutex_chunk);
+        // the small blocks keep the chunk aligned to 16 bytes
+        if (cls >= cnt_class_small && chunk_cur)
+            chunk_cur = std::min(chunk_end, chunk_cur + (-reinterpret_cast<uintptr_t>(chunk_cur) & 63));
+        // whole blocks, which may add up to more than the batch
+        const size_t cnt_block = (size_want + size_block - 1) / size_block;
+        if (size_t(chunk_end - chunk_cur) < cnt_block * size_block) {
+            // the tail of the previous chunk is left unused
+            chunk_cur = static_cast<char *>(map(size_chunk));
+            chunk_end = chunk_cur + size_chunk;
+        }
+        for (size_t i = 0; i < cnt_block; ++i) {
+            next_of(chunk_cur) = c.head[cls];
+            c.head[cls] = chunk_cur;
+            c.size[cls] += size_block;
+            chunk_cur += size_block;
+        }
+    }
+
+    // Move a batch of blocks from a cache that has grown too large to the
+    // shared list of the class
+    void spill(cache &c, uint32_t cls) {
+        const size_t size_block = size_of_class(cls);
+        const size_t cnt = (size_batch_of(cls) + size_block - 1) / size_block;
+        void *first = c.head[cls], *last = first;
+        for (size_t i = 1; i < cnt; ++i) last = next_of(last);
+        c.head[cls] = next_of(last);
+        c.size[cls] -= cnt * size_block;
+
+        free_list &list = list_free[cls];
+        std::lock_guard<std::mutex> lock(list.mutex);
+        next_of(last) = list.head;
+        list.head = first;
+    }
+
+    void give_back(uint32_t cls, void *first) {
+        void *last = first;
+        while (next_of(last)) last = next_of(last);
+        free_list &list = list_free[cls];
+        std::lock_guard<std::mutex> lock(list.mutex);
+        next_of(last) = list.head;
+        list.head = first;
+    }
+
+    std::atomic<huge_page_mode> mode_{huge_page_mode::NONE};
+    std::atomic<bool> used{false};
+
+    free_list list_free[cnt_class];
+    std::mutex mutex_chunk;  // the current chunk
+    char *chunk_cur = nullptr, *chunk_end = nullptr;
+
+    mutable std::mutex mutex_region;  // the fields below
+    std::map<uintptr_t, size_t> list_region;  // the start and size of the mappings
+    size_t cnt_fallback = 0;
+};
+
+// for std::unique_ptr
+struct huge_page_deleter {
+    void operator()(void *p) const {
+        huge_page_pool::deallocate(p);
+    }
+};
+
+// The allocator of containers whose storage is index memory, e.g., the node pool
+template <typename T>
+struct huge_page_allocator {
+    using value_type = T;
+
+    huge_page_allocator() = default;
+    template <typename E>
+    huge_page_allocator(const huge_page_allocator<E> &) {}
+
+    T *allocate(size_t n) {
+        return static_cast<T *>(huge_page_pool::global().allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t) {
+        huge_page_pool::deallocate(p);
+    }
+
+    template <typename E>
+    bool operator==(const huge_page_allocator<E> &) const {
+        return true;
+    }
+    template <typename E>
+    bool operator!=(const huge_page_allocator<E> &) const {
+        return false;
+    }
+};
+
+}  // namespace ANN
+
+#endif  // _HNSW_HUGE_PAGE_HPP
@@ -0,0 +1,190 @@
+#ifndef _HNSW_INDEX_HOLDER_HPP
+#define _HNSW_INDEX_HOLDER_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "HNSW.hpp"
+
+namespace ANN {
+
+// Serves one version of an index at a time and replaces it without stopping
+// the queries. A query acquires a snapshot and keeps searching it even when a
+// newer version has been swapped in; the previous version is destroyed on the
+// reloading thread once the last snapshot of it is released
+template <class Index>
+class index_holder {
+public:
+    using snapshot = std::shared_ptr<Index>;
+
+    struct version_info {
+        uint64_t version = 0;
+        std::string source;
+        double time_load = 0;  // in seconds, including the warm-up if any
+        size_t bytes = 0;      // Index::memory_footprint() after loading
+        long cnt_ref = 0;      // snapshots still held, besides the holder
+    };
+
+    struct report {
+        version_info current;
+        // the replaced versions that queries are still running on
+        std::vector<version_info> draining;
+    };
+
+    index_holder() = default;
+
+    // Start serving an index that is already loaded
+    explicit index_holder(Index &&index, std::string source = {}) {
+        install(std::make_shared<Index>(std::move(index)), std::move(source), 0);
+    }
+
+    index_holder(const index_holder &) = delete;
+    index_holder &operator=(const index_holder &) = delete;
+
+    ~index_holder() {
+        // the reloads use the holder until they finish, including the ones
+        // not yet running; queries still holding snapshots keep their
+        // version alive
+        std::unique_lock<std::mutex> lock(mutex_pending);
+        cv_pending.wait(lock, [&] {
+            return cnt_pending == 0;
+        });
+    }
+
+    // The version to run a query on; null if nothing is loaded yet
+    snapshot acquire() const {
+        return std::atomic_load_explicit(&current, std::memory_order_acquire);
+    }
+
+    // Build the next version with `load` (which returns an Index) in the
+    // background and swap it in. The future is ready once the previous
+    // version is released; a failed load leaves the current one serving and
+    // rethrows from the future. Reloads are done one at a time
+    template <class F>
+    std::future<void> reload(std::string source, F load) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_pending);
+            ++cnt_pending;
+        }
+        try {
+            return std::async(std::launch::async, [this, source = std::move(source),
+                              load = std::move(load)]() mutable {
+                // counted off last, after which the holder may be destroyed
+                std::unique_ptr<index_holder, void (*)(index_holder *)> guard_pending(
+                this, [](index_holder *holder) {
+                    holder->finish_reload();
+                });
+                std::lock_guard<std::mutex> lock(mutex_reload);
+                const auto t = std::chrono::steady_clock::now();
+                auto next = std::make_shared<Index>(load());
+                const double time_load = std::chrono::duration<double>(
+                                             std::chrono::steady_clock::now() - t).count();
+                install(std::move(next), std::move(source), time_load);
+                drain();
+            });
+        } catch (...) {
+            finish_reload();
+            throw;
+        }
+    }
+
+    // Reload from a saved model; see HNSW(filename_model, getter)
+    template <class G>
+    std::future<void> reload_model(const std::string &filename_model, G getter) {
+        return reload(filename_model, [filename_model, getter] {
+            return Index(filename_model, getter);
+        });
+    }
+
+    report stats() const {
+        report res;
+        std::lock_guard<std::mutex> lock(mutex_info);
+        res.current = info_current;
+        const snapshot s = acquire();
+        // one reference is the holder's own
+        if (s) res.current.cnt_ref = s.use_count() - 2;
+        for (const auto &[index, info] : list_draining) {
+            res.draining.push_back(info);
+            res.draining.back().cnt_ref = index.use_count() - 1;
+        }
+        return res;
+    }
+
+private:
+    void finish_reload() {
+        // notified under the lock, so that the destructor cannot return
+        // before this is done with the condition variable
+        std::lock_guard<std::mutex> lock(mutex_pending);
+        --cnt_pending;
+        cv_pending.notify_all();
+    }
+
+    void install(snapshot next, std::string source, double time_load) {
+        version_info info;
+        info.source = std::move(source);
+        info.time_load = time_load;
+        info.bytes = next->memory_footprint();
+
+        std::lock_guard<std::mutex> lock(mutex_info);
+        info.version = ++cnt_version;
+        snapshot prev = std::atomic_exchange_explicit(&current, std::move(next),
+                        std::memory_order_acq_rel);
+        if (prev) list_draining.emplace_back(std::move(prev), info_current);
+        spdlog::info("Serving version {} from '{}': loaded in {:.3f}s, {} MB",
+                     info.version, info.source, info.time_load, info.bytes >> 20);
+        info_current = std::move(info);
+    }
+
+    // Wait for the queries on the replaced versions to finish and destroy
+    // them here rather than on the thread of the last query
+    void drain() {
+        while (true) {
+            std::vector<std::pair<snapshot, version_info>> drained;
+            {
+                std::lock_guard<std::mutex> lock(mutex_info);
+                if (list_draining.empty()) return;
+                // no snapshot of a replaced version can be acquired anymore,
+                // so a count of one stays one
+                auto it = std::partition(list_draining.begin(), list_draining.end(),
+                [](const auto &x) {
+                    return x.first.use_count() > 1;
+                });
+                drained.assign(std::make_move_iterator(it),
+                               std::make_move_iterator(list_draining.end()));
+                list_draining.erase(it, list_draining.end());
+            }
+            for (auto &[index, info] : drained) {
+                index.reset();
+                spdlog::info("Released version {} ({} MB)", info.version,
+                             info.bytes >> 20);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    snapshot current;
+    std::mutex mutex_reload;
+    std::mutex mutex_pending;  // `cnt_pending`, the reloads started and not done
+    std::condition_variable cv_pending;
+    size_t cnt_pending = 0;
+    mutable std::mutex mutex_info;  // the fields below
+    uint64_t cnt_version = 0;
+    version_info info_current;
+    std::vector<std::pair<snapshot, version_info>> list_draining;
+};
+
+}  // namespace ANN
+
+#endif  // _HNSW_INDEX_HOLDER_HPP
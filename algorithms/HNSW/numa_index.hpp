@@ -0,0 +1,140 @@
+#ifndef _HNSW_NUMA_INDEX_HPP
+#define _HNSW_NUMA_INDEX_HPP
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef SUPPORT_NUMA
+#include <numa.h>
+#endif
+
+#include "HNSW.hpp"
+
+namespace ANN {
+
+// A read-only version 4 model replicated on every NUMA node. Each replica is
+// a copy of the whole file in memory bound to its node, so the levels, the
+// adjacency and the embedded vectors (if any) are all local to it. A query is
+// served by the replica on the node of the CPU that runs it, and the threads
+// that search can be pinned to the nodes in blocks of parlay workers.
+// Without SUPPORT_NUMA (libnuma), or on a single node, the model is mapped
+// once as usual
+template <typename U, template <typename> class Allocator = std::allocator>
+class numa_index {
+public:
+    using index = HNSW<U, Allocator>;
+    using node_id = typename index::node_id;
+    using T = typename U::type_point;
+
+    // A non-null getter provides the vectors to every replica, which leaves
+    // them wherever the caller placed them; embed them to replicate them too
+    template <typename G = std::nullptr_t>
+    explicit numa_index(const std::string &filename_model, G getter = nullptr,
+                        bool pin = true)
+        : pin(pin) {
+#ifdef SUPPORT_NUMA
+        if (numa_available() != -1 && numa_num_configured_nodes() > 1) {
+            replicate(filename_model, getter);
+            return;
+        }
+#endif
+        list_replica.push_back(std::make_unique<index>(filename_model, getter));
+        spdlog::info("A single NUMA node; serving one mapped model");
+    }
+
+    parlay::sequence<std::pair<node_id, float>> search(
+                const T &q, uint32_t k, uint32_t ef, const search_control &ctrl = {}) {
+        return local().search(q, k, ef, ctrl);
+    }
+
+    // The replica to be used by the calling thread, which is pinned to a node
+    // first if requested
+    index &local() {
+        if (list_replica.size() == 1) return *list_replica[0];
+#ifdef SUPPORT_NUMA
+        thread_local const numa_index *pinned = nullptr;
+        if (pin && pinned != this) {
+            const size_t w = parlay::worker_id();
+            const int node = list_node[w * list_node.size() / parlay::num_workers()];
+            if (numa_run_on_node(node) == 0) pinned = this;
+        }
+#endif
+        const int cpu = sched_getcpu();
+        if (cpu < 0 || size_t(cpu) >= replica_of_cpu.size()) return *list_replica[0];
+        return *list_replica[replica_of_cpu[cpu]];
+    }
+
+    size_t cnt_replica() const {
+        return list_replica.size();
+    }
+
+    index &replica(size_t i) {
+        return *list_replica[i];
+    }
+
+    size_t memory_footprint() const {
+        size_t size = 0;
+        for (const auto &r : list_replica) size += r->memory_footprint();
+        return size;
+    }
+
+private:
+#ifdef SUPPORT_NUMA
+    template <typename G>
+    void replicate(const std::string &filename_model, G getter) {
+        const int fd = open(filename_model.c_str(), O_RDONLY);
+        if (fd == -1) throw std::runtime_error("Failed to open the model");
+        std::unique_ptr<int, void (*)(int *)> guard_fd(new int(fd), [](int *fd) {
+            close(*fd);
+            delete fd;
+        });
+        struct stat sb;
+        if (fstat(fd, &sb) == -1) throw std::runtime_error("Failed to open the model");
+        const size_t size = sb.st_size;
+
+        std::vector<size_t> replica_of_node(numa_max_node() + 1, 0);
+        for (int node = 0; node <= numa_max_node(); ++node) {
+            if (numa_node_size64(node, nullptr) <= 0) continue;  // no memory
+            // the pages are bound to the node whoever touches them first
+            void *p = numa_alloc_onnode(size, node);
+            if (!p) throw std::runtime_error("Failed to allocate on a NUMA node");
+            // outside the pool, a replica can only take transparent huge pages
+            if (huge_page_pool::global().mode() != huge_page_mode::NONE)
+                madvise(p, size, MADV_HUGEPAGE);
+            std::shared_ptr<void> region(p, [size](void *p) {
+                numa_free(p, size);
+            });
+            index::read_parallel(fd, static_cast<char *>(p), size, 0);
+            replica_of_node[node] = list_replica.size();
+            list_replica.push_back(std::make_unique<index>(std::move(region), size, getter));
+            list_node.push_back(node);
+        }
+
+        replica_of_cpu.resize(numa_num_configured_cpus());
+        for (size_t cpu = 0; cpu < replica_of_cpu.size(); ++cpu) {
+            const int node = numa_node_of_cpu(cpu);
+            replica_of_cpu[cpu] = node < 0 ? 0 : replica_of_node[node];
+        }
+        spdlog::info("Replicated the model on {} NUMA nodes ({} MB each)",
+                     list_replica.size(), size >> 20);
+    }
+#endif
+
+    bool pin;
+    std::vector<std::unique_ptr<index>> list_replica;
+    std::vector<int> list_node;          // the node of each replica
+    std::vector<size_t> replica_of_cpu;  // the replica local to each CPU
+};
+
+}  // namespace ANN
+
+#endif  // _HNSW_NUMA_INDEX_HPP
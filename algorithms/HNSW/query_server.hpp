@@ -0,0 +1,328 @@
+#ifndef _HNSW_QUERY_SERVER_HPP
+#define _HNSW_QUERY_SERVER_HPP
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "HNSW.hpp"
+#include "index_holder.hpp"
+
+namespace ANN {
+
+// Collects the queries submitted one at a time into micro-batches, which a
+// dispatcher thread searches with all the parlay workers on the version of
+// the index being served. An optional Unix-domain socket front end feeds the
+// same queue, mostly for testing. Under load, the queries are cut short at
+// their deadlines and the ef is lowered as the queue grows (server_control)
+template <typename U, template <typename> class Allocator = std::allocator>
+class query_server {
+public:
+    using index = HNSW<U, Allocator>;
+    using node_id = typename index::node_id;
+    using type_elem = typename U::type_elem;
+    using result = parlay::sequence<std::pair<node_id, float>>;
+    using time_point = std::chrono::steady_clock::time_point;
+
+    struct answer {
+        result neighbors;
+        uint32_t ef;     // the ef actually searched with
+        bool truncated;  // stopped at the deadline with the best so far
+    };
+
+    query_server(index_holder<index> &holder, const server_control &ctrl = {})
+        : holder(holder), ctrl(ctrl), dispatcher([this] {
+        run();
+    }) {}
+
+    query_server(const query_server &) = delete;
+    query_server &operator=(const query_server &) = delete;
+
+    ~query_server() {
+        stop();
+    }
+
+    // Queue a query of `dim` elements, which are copied. Its deadline is the
+    // earlier of `deadline` and the SLO of the server
+    std::future<answer> submit(const type_elem *q, uint32_t dim, uint32_t k,
+                               uint32_t ef, std::optional<time_point> deadline = {}) {
+        const auto now = std::chrono::steady_clock::now();
+        if (ctrl.slo) {
+            const auto t = now + std::chrono::microseconds(ctrl.slo);
+            deadline = deadline ? std::min(*deadline, t) : t;
+        }
+        request req{std::vector<type_elem>(q, q + dim), k, ef, {}, now, deadline};
+        auto res = req.promise.get_future();
+        std::unique_lock<std::mutex> lock(mutex);
+        if (stopping) {
+            req.promise.set_exception(
+                std::make_exception_ptr(std::runtime_error("The server is stopped")));
+            return res;
+        }
+        queue.push_back(std::move(req));
+        // the dispatcher only cares about the first query and a full batch
+        if (queue.size() == 1 || queue.size() == ctrl.batch_max) {
+            lock.unlock();
+            cv.notify_one();
+        }
+        return res;
+    }
+
+    // Serve the queries sent to a Unix-domain socket at `path`. A request is
+    // `uint32_t k, ef, dim` followed by `dim` elements, and the reply is
+    // `uint32_t cnt, truncated` followed by `cnt` pairs of `node_id id, float dist`.
+    // Only one socket is served at a time
+    void listen_unix(const std::string &path) {
+        if (fd_listen != -1)
+            throw std::runtime_error("Already listening on " + path_socket);
+        sockaddr_un addr{};
+        if (path.size() >= sizeof(addr.sun_path))
+            throw std::invalid_argument("The socket path is too long");
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.c_str(), path.size());
+
+        fd_listen = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd_listen == -1) throw std::runtime_error("Failed to create the socket");
+        unlink(path.c_str());
+        if (bind(fd_listen, (const sockaddr *)&addr, sizeof(addr)) == -1 ||
+                listen(fd_listen, 64) == -1) {
+            close(fd_listen);
+            fd_listen = -1;
+            throw std::runtime_error("Failed to listen on " + path);
+        }
+        path_socket = path;
+        acceptor = std::thread([this] {
+            while (true) {
+                const int fd = accept(fd_listen, nullptr, nullptr);
+                if (fd == -1) {
+                    if (errno == EINTR || errno == ECONNABORTED) continue;
+                    return;  // the listener is shut down
+                }
+                std::lock_guard<std::mutex> lock(mutex_conn);
+                reap();
+                auto &c = list_conn.emplace_back();
+                c.fd = fd;
+                c.thread = std::thread([this, &c] {
+                    serve(c.fd);
+                    std::lock_guard<std::mutex> lock(mutex_conn);
+                    close(c.fd);
+                    c.done = true;
+                });
+            }
+        });
+        spdlog::info("Serving queries on {}", path);
+    }
+
+    // Answer what is queued, then refuse any further query
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) return;
+            stopping = true;
+        }
+        cv.notify_one();
+        dispatcher.join();
+
+        if (fd_listen != -1) {
+            shutdown(fd_listen, SHUT_RDWR);
+            acceptor.join();
+            close(fd_listen);
+            unlink(path_socket.c_str());
+        }
+        // join outside the lock, which the connections take to finish
+        std::list<connection> list;
+        {
+            std::lock_guard<std::mutex> lock(mutex_conn);
+            for (auto &c : list_conn)
+                if (!c.done) shutdown(c.fd, SHUT_RDWR);
+            list.swap(list_conn);
+        }
+        for (auto &c : list)
+            c.thread.join();
+    }
+
+    size_t cnt_query() const {
+        return total_query.load(std::memory_order_relaxed);
+    }
+
+    size_t cnt_batch() const {
+        return total_batch.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct request {
+        std::vector<type_elem> q;
+        uint32_t k, ef;
+        std::promise<answer> promise;
+        time_point time_arrival;
+        std::optional<time_point> deadline;
+    };
+
+    struct connection {
+        int fd;
+        bool done = false;  // the fd is closed, guarded by `mutex_conn`
+        std::thread thread;
+    };
+
+    // join the connections whose client has gone, with `mutex_conn` held
+    void reap() {
+        for (auto it = list_conn.begin(); it != list_conn.end();) {
+            if (!it->done) {
+                ++it;
+                continue;
+            }
+            it->thread.join();
+            it = list_conn.erase(it);
+        }
+    }
+
+    void run() {
+        const auto wait_max = std::chrono::microseconds(ctrl.wait_max);
+        while (true) {
+            std::vector<request> batch;
+            size_t depth;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] {
+                    return stopping || !queue.empty();
+                });
+                if (queue.empty()) return;
+                // hold the batch open until it is full or its first query
+                // has waited long enough
+                cv.wait_until(lock, queue.front().time_arrival + wait_max, [&] {
+                    return stopping || queue.size() >= ctrl.batch_max;
+                });
+                const size_t size = std::min<size_t>(queue.size(), ctrl.batch_max);
+                batch.reserve(size);
+                std::move(queue.begin(), queue.begin() + size, std::back_inserter(batch));
+                queue.erase(queue.begin(), queue.begin() + size);
+                depth = queue.size();
+            }
+            process(batch, depth);
+        }
+    }
+
+    // the ef to search with while `depth` queries are waiting
+    uint32_t adjust_ef(uint32_t ef, uint32_t k, size_t depth) const {
+        if (!ctrl.depth_step || depth < ctrl.depth_step) return ef;
+        const float scale = std::pow(ctrl.ef_decay, float(depth / ctrl.depth_step));
+        const uint32_t ef_min = std::min(ef, std::max(k, ctrl.ef_floor));
+        return std::max(ef_min, uint32_t(ef * scale));
+    }
+
+    void process(std::vector<request> &batch, size_t depth) {
+        const auto snapshot = holder.acquire();
+        parlay::parallel_for(0, batch.size(), [&](size_t i) {
+            request &req = batch[i];
+            try {
+                if (!snapshot) throw std::runtime_error("No index is loaded");
+                const typename U::type_point q(uint32_t(i), req.q.data());
+                answer res{{}, adjust_ef(req.ef, req.k, depth), false};
+                search_control c{};
+                c.deadline = req.deadline;
+                c.truncated = &res.truncated;
+                res.neighbors = snapshot->search(q, req.k, res.ef, c);
+                req.promise.set_value(std::move(res));
+            } catch (...) {
+                req.promise.set_exception(std::current_exception());
+            }
+        }, 1);
+        total_query.fetch_add(batch.size(), std::memory_order_relaxed);
+        total_batch.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static bool transfer(int fd, void *buf, size_t size, bool is_read) {
+        for (char *p = static_cast<char *>(buf); size > 0;) {
+            const ssize_t cnt = is_read ? recv(fd, p, size, 0)
+                                : send(fd, p, size, MSG_NOSIGNAL);
+            if (cnt == -1 && errno == EINTR) continue;
+            if (cnt <= 0) return false;
+            p += cnt;
+            size -= cnt;
+        }
+        return true;
+    }
+
+    // one request at a time per connection; a client that wants more in
+    // flight opens more connections
+    void serve(int fd) {
+        std::vector<type_elem> q;
+        std::vector<char> reply;
+        while (true) {
+            uint32_t header[3];
+            if (!transfer(fd, header, sizeof(header), true)) return;
+            const auto [k, ef, dim] = header;
+            if (auto s = holder.acquire(); dim == 0 || (s && dim != s->dim)) {
+                spdlog::warn("Dropped a connection sending queries of dimension {}", dim);
+                return;
+            }
+            if (k == 0 || k > ctrl.ef_max || ef > ctrl.ef_max) {
+                spdlog::warn("Dropped a connection asking for k={} ef={}", k, ef);
+                return;
+            }
+            q.resize(dim);
+            if (!transfer(fd, q.data(), dim * sizeof(type_elem), true)) return;
+
+            answer res;
+            try {
+                res = submit(q.data(), dim, k, ef).get();
+            } catch (const std::exception &e) {
+                spdlog::warn("Failed to answer a query: {}", e.what());
+                return;
+            }
+            const uint32_t head[2] = {uint32_t(res.neighbors.size()), res.truncated};
+            reply.resize(sizeof(head) + head[0] * (sizeof(node_id) + sizeof(float)));
+            char *p = reply.data();
+            memcpy(p, head, sizeof(head));
+            p += sizeof(head);
+            for (const auto &[id, d] : res.neighbors) {
+                memcpy(p, &id, sizeof(id));
+                memcpy(p + sizeof(id), &d, sizeof(d));
+                p += sizeof(id) + sizeof(d);
+            }
+            if (!transfer(fd, reply.data(), reply.size(), false)) return;
+        }
+    }
+
+    index_holder<index> &holder;
+    const server_control ctrl;
+
+    std::mutex mutex;  // the queue and `stopping`
+    std::condition_variable cv;
+    std::deque<request> queue;
+    bool stopping = false;
+    std::atomic<size_t> total_query{0};
+    std::atomic<size_t> total_batch{0};
+
+    int fd_listen = -1;
+    std::string path_socket;
+    std::thread acceptor;
+    std::mutex mutex_conn;
+    std::list<connection> list_conn;
+
+    // started last, as it uses the members above
+    std::thread dispatcher;
+};
+
+}  // namespace ANN
+
+#endif  // _HNSW_QUERY_SERVER_HPP
@@ -0,0 +1,362 @@
+#ifndef _HNSW_RCU_HPP
+#define _HNSW_RCU_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "huge_page.hpp"
+#include "parlay/parallel.h"
+#include "parlay/slice.h"
+
+namespace ANN {
+
+// Epoch-based reclamation. A reader announces the global epoch when entering
+// a critical section and withdraws it on leaving, which is a pair of stores
+// and never waits. Writers retire what they have unlinked, tagged with the
+// epoch at that time, and reclaim() frees whatever was retired before the
+// oldest epoch still announced, i.e., what no reader can still hold
+class epoch_domain {
+    static constexpr uint64_t idle = 0;
+
+    struct retired {
+        uint64_t epoch;
+        void *p;
+        void (*deleter)(void *);
+    };
+
+    // one per thread, recycled once the thread exits
+    struct record {
+        std::atomic<uint64_t> epoch{idle};
+        std::atomic<bool> in_use{true};
+        uint32_t depth = 0;  // nesting of the guards, owned by the thread
+        std::mutex mutex;    // the retired list against reclaim()
+        std::vector<retired> list_retired;
+        record *next = nullptr;
+    };
+
+public:
+    static epoch_domain &global() {
+        static epoch_domain domain;
+        return domain;
+    }
+
+    // Keeps whatever the thread reads from being freed until it goes out of
+    // scope; guards may nest
+    class guard {
+    public:
+        explicit guard(epoch_domain &d = global()) : rec(d.get_record()) {
+            if (rec.depth++ == 0) {
+                rec.epoch.store(d.epoch.load(std::memory_order_seq_cst),
+                                std::memory_order_seq_cst);
+                // pairs with the fence in reclaim(): either the reclaimer
+                // sees this epoch or this thread sees what was unlinked
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+            }
+        }
+
+        guard(const guard &) = delete;
+        guard &operator=(const guard &) = delete;
+
+        ~guard() {
+            if (--rec.depth == 0) rec.epoch.store(idle, std::memory_order_release);
+        }
+
+    private:
+        record &rec;
+    };
+
+    // Free `p` with `deleter` once the readers that may have seen it are gone
+    void retire(void *p, void (*deleter)(void *)) {
+        record &rec = get_record();
+        std::lock_guard<std::mutex> lock(rec.mutex);
+        rec.list_retired.push_back({epoch.load(std::memory_order_seq_cst), p, deleter});
+    }
+
+    // Start a new epoch and free what was retired before every active reader;
+    // returns the number of objects freed
+    size_t reclaim() {
+        const uint64_t e = epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+        // orders the unlinking stores before the scan of the announced epochs
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint64_t oldest = e;
+        for (record *r = head.load(std::memory_order_acquire); r; r = r->next) {
+            const uint64_t a = r->epoch.load(std::memory_order_seq_cst);
+            if (a != idle) oldest = std::min(oldest, a);
+        }
+
+        size_t cnt = 0;
+        for (record *r = head.load(std::memory_order_acquire); r; r = r->next) {
+            std::vector<retired> expired;
+            {
+                std::lock_guard<std::mutex> lock(r->mutex);
+                auto &list = r->list_retired;
+                auto it = std::stable_partition(list.begin(), list.end(),
+                [&](const retired &x) {
+                    return x.epoch >= oldest;
+                });
+                expired.assign(it, list.end());
+                list.erase(it, list.end());
+            }
+            for (const retired &x : expired) x.deleter(x.p);
+            cnt += expired.size();
+        }
+        return cnt;
+    }
+
+private:
+    epoch_domain() = default;
+
+    record &get_record() {
+        struct holder {
+            record *rec = nullptr;
+            ~holder() {
+                if (rec) rec->in_use.store(false, std::memory_order_release);
+            }
+        };
+        static thread_local holder h;
+        if (h.rec) return *h.rec;
+
+        for (record *r = head.load(std::memory_order_acquire); r; r = r->next) {
+            bool expected = false;
+            if (r->in_use.compare_exchange_strong(expected, true)) return *(h.rec = r);
+        }
+        // records are never freed, so the list is only ever prepended to
+        auto *r = new record;
+        r->next = head.load(std::memory_order_relaxed);
+        while (!head.compare_exchange_weak(r->next, r, std::memory_order_release,
+                                           std::memory_order_relaxed));
+        return *(h.rec = r);
+    }
+
+    std::atomic<uint64_t> epoch{1};
+    std::atomic<record *> head{nullptr};
+};
+
+// A list that readers load as an immutable snapshot with one acquire load,
+// while a writer replaces it as a whole by publishing a new block and
+// retiring the old one to the epoch domain. Writers of the same list must
+// not race with each other
+template <typename E>
+class rcu_list {
+    static_assert(std::is_trivially_copyable_v<E>);
+
+    struct block {
+        size_t size;
+        E *data() {
+            return reinterpret_cast<E *>(this + 1);
+        }
+    };
+    static_assert(alignof(block) >= alignof(E));
+
+public:
+    using view_type = parlay::slice<const E *, const E *>;
+
+    rcu_list() = default;
+
+    rcu_list(const rcu_list &) = delete;
+    rcu_list &operator=(const rcu_list &) = delete;
+
+    // moves and destruction are only for lists without any reader left
+    rcu_list(rcu_list &&other) noexcept
+        : ptr(other.ptr.exchange(nullptr, std::memory_order_relaxed)) {}
+
+    rcu_list &operator=(rcu_list &&other) noexcept {
+        if (this != &other) {
+            huge_page_pool::deallocate(ptr.load(std::memory_order_relaxed));
+            ptr.store(other.ptr.exchange(nullptr, std::memory_order_relaxed),
+                      std::memory_order_relaxed);
+        }
+        return *this;
+    }
+
+    ~rcu_list() {
+        huge_page_pool::deallocate(ptr.load(std::memory_order_relaxed));
+    }
+
+    // The current version; it stays valid within an epoch guard
+    view_type view() const {
+        block *b = ptr.load(std::memory_order_acquire);
+        if (!b) return view_type(nullptr, nullptr);
+        const E *p = b->data();
+        return view_type(p, p + b->size);
+    }
+
+    // every call reads the current version; take a view() for a consistent one
+    size_t size() const {
+        return view().size();
+    }
+    bool empty() const {
+        return size() == 0;
+    }
+    E operator[](size_t i) const {
+        return view()[i];
+    }
+
+    template <class R, class = decltype(std::begin(std::declval<const R &>()))>
+    rcu_list &operator=(const R &r) {
+        publish(std::begin(r), std::end(r));
+        return *this;
+    }
+
+    rcu_list &operator=(std::initializer_list<E> r) {
+        publish(r.begin(), r.end());
+        return *this;
+    }
+
+    template <class Iter>
+    void publish(Iter begin, Iter end) {
+        const size_t size = std::distance(begin, end);
+        block *b = nullptr;
+        if (size > 0) {
+            b = static_cast<block *>(
+                    huge_page_pool::global().allocate(sizeof(block) + size * sizeof(E)));
+            b->size = size;
+            std::copy(begin, end, b->data());
+        }
+        block *old = ptr.exchange(b, std::memory_order_acq_rel);
+        if (old) epoch_domain::global().retire(old, huge_page_pool::deallocate);
+    }
+
+private:
+    std::atomic<block *> ptr{nullptr};
+};
+
+// An array that readers index through one acquire load of its block, while
+// a single writer appends to it. Growing past the capacity moves the elements
+// to a larger block, publishes it and retires the old one, whose elements are
+// only destroyed once no reader can hold them; the elements must stay valid
+// to read from after being moved. Readers only reach the elements that were
+// constructed before they were told about them
+template <typename E>
+class rcu_array {
+    struct block {
+        size_t capacity;
+        size_t size;  // the elements constructed; written by the writer only
+        E *data() {
+            return reinterpret_cast<E *>(this + 1);
+        }
+    };
+    static_assert(alignof(block) >= alignof(E));
+
+public:
+    rcu_array() = default;
+
+    rcu_array(const rcu_array &) = delete;
+    rcu_array &operator=(const rcu_array &) = delete;
+
+    // moves and destruction are only for arrays without any reader left
+    rcu_array(rcu_array &&other) noexcept
+        : ptr(other.ptr.exchange(nullptr, std::memory_order_relaxed)) {}
+
+    rcu_array &operator=(rcu_array &&other) noexcept {
+        if (this != &other) {
+            destroy(ptr.load(std::memory_order_relaxed));
+            ptr.store(other.ptr.exchange(nullptr, std::memory_order_relaxed),
+                      std::memory_order_relaxed);
+        }
+        return *this;
+    }
+
+    ~rcu_array() {
+        destroy(ptr.load(std::memory_order_relaxed));
+    }
+
+    E &operator[](size_t i) {
+        return ptr.load(std::memory_order_acquire)->data()[i];
+    }
+    const E &operator[](size_t i) const {
+        return ptr.load(std::memory_order_acquire)->data()[i];
+    }
+
+    E *data() {
+        block *b = ptr.load(std::memory_order_acquire);
+        return b ? b->data() : nullptr;
+    }
+    const E *data() const {
+        return const_cast<rcu_array *>(this)->data();
+    }
+
+    // the writer's view
+    size_t size() const {
+        block *b = ptr.load(std::memory_order_relaxed);
+        return b ? b->size : 0;
+    }
+    size_t capacity() const {
+        block *b = ptr.load(std::memory_order_relaxed);
+        return b ? b->capacity : 0;
+    }
+
+    // Value-initialize the elements up to `size`, or destroy those past it
+    // (only without readers)
+    void resize(size_t size) {
+        block *b = ptr.load(std::memory_order_relaxed);
+        if (!b && size == 0) return;
+        const size_t size_old = b ? b->size : 0;
+        if (size > (b ? b->capacity : 0)) {
+            block *next = allocate(std::max(size, (b ? b->capacity : 0) * 2));
+            parlay::parallel_for(0, size_old, [&](size_t i) {
+                new (next->data() + i) E(std::move(b->data()[i]));
+            });
+            next->size = size_old;
+            ptr.store(next, std::memory_order_release);
+            if (b) epoch_domain::global().retire(b, destroy);
+            b = next;
+        }
+        if (size > size_old) {
+            parlay::parallel_for(size_old, size, [&](size_t i) {
+                new (b->data() + i) E();
+            });
+        } else {
+            std::destroy(b->data() + size, b->data() + size_old);
+        }
+        b->size = size;
+    }
+
+    // Replace the elements with f(0), ..., f(size-1) (only without readers)
+    template <class F>
+    void assign(size_t size, F f) {
+        block *b = allocate(size);
+        parlay::parallel_for(0, size, [&](size_t i) {
+            new (b->data() + i) E(f(i));
+        });
+        b->size = size;
+        destroy(ptr.exchange(b, std::memory_order_acq_rel));
+    }
+
+    void clear() {
+        destroy(ptr.exchange(nullptr, std::memory_order_acq_rel));
+    }
+
+private:
+    static block *allocate(size_t capacity) {
+        auto *b = static_cast<block *>(
+                      huge_page_pool::global().allocate(sizeof(block) + capacity * sizeof(E)));
+        b->capacity = capacity;
+        b->size = 0;
+        return b;
+    }
+
+    static void destroy(void *p) {
+        if (!p) return;
+        auto *b = static_cast<block *>(p);
+        std::destroy(b->data(), b->data() + b->size);
+        huge_page_pool::deallocate(b);
+    }
+
+    std::atomic<block *> ptr{nullptr};
+};
+
+}  // namespace ANN
+
+#endif  // _HNSW_RCU_HPP
@@ -0,0 +1,305 @@
+#ifndef _HNSW_SHARDED_HPP
+#define _HNSW_SHARDED_HPP
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "HNSW.hpp"
+
+namespace ANN {
+
+// how the points are assigned to the shards: by a hash of their ids, or to
+// the nearest of centroids found by k-means on a sample, which also lets the
+// queries probe only the nearest shards
+enum class shard_mode : uint32_t { RANDOM, KMEANS };
+
+// Independent HNSW indexes over a partition of the points, built in parallel,
+// searched by fanning out and merging the per-shard top-k lists, and saved
+// as one model per shard plus a manifest so that they can be rebuilt and
+// swapped in one at a time
+template <typename U, template <typename> class Allocator = std::allocator>
+class HNSW_sharded {
+    using T = typename U::type_point;
+    using type_elem = typename U::type_elem;
+
+public:
+    using index = HNSW<U, Allocator>;
+    using node_id = typename index::node_id;
+
+    template <typename Iter>
+    HNSW_sharded(Iter begin, Iter end, uint32_t dim, uint32_t cnt_shard,
+                 shard_mode mode = shard_mode::RANDOM, float m_l = 16,
+                 uint32_t m = 16, uint32_t ef_construction = 50, float alpha = 5,
+                 float batch_base = 2, const build_control &ctrl = {});
+
+    // load the manifest and every shard; see HNSW(filename_model, getter)
+    template <typename G>
+    HNSW_sharded(const std::string &filename_manifest, G getter);
+
+    // Search the `cnt_probe` shards with the nearest centroids, or all of them
+    // if zero or unrouted, and merge their results
+    parlay::sequence<std::pair<node_id, float>> search(
+                const T &q, uint32_t k, uint32_t ef, const search_control &ctrl = {},
+                uint32_t cnt_probe = 0) const;
+
+    // The shard that a point belongs to
+    uint32_t route(const T &p) const;
+
+    // the shards are written to `filename_manifest` followed by ".<i>"
+    void save(const std::string &filename_manifest, uint32_t version = 3,
+              type_payload payload = type_payload::NONE) const;
+
+    void save_shard(uint32_t i, const std::string &filename_manifest,
+                    uint32_t version = 3,
+                    type_payload payload = type_payload::NONE) const {
+        get_shard(i)->save(filename_shard(filename_manifest, i), version, payload);
+    }
+
+    // Swap in a rebuilt shard; searches already running keep the old one
+    void replace_shard(uint32_t i, index &&shard) {
+        std::atomic_store(&list_shard[i], std::make_shared<index>(std::move(shard)));
+    }
+
+    std::shared_ptr<index> get_shard(uint32_t i) const {
+        return std::atomic_load(&list_shard[i]);
+    }
+
+    static std::string filename_shard(const std::string &filename_manifest,
+                                      uint32_t i) {
+        return filename_manifest + "." + std::to_string(i);
+    }
+
+    uint32_t dim;
+    uint32_t cnt_shard;
+    shard_mode mode;
+    parlay::sequence<float> centroid;  // cnt_shard*dim, KMEANS only
+
+private:
+    static constexpr char magic_manifest[8] = {'H', 'N', 'S', 'W', 'S', 'H', 'R', 'D'};
+
+    float dist_centroid(const T &p, uint32_t c) const {
+        float d = 0;
+        for (uint32_t j = 0; j < dim; ++j) {
+            const float diff = float(p.coord[j]) - centroid[size_t(c) * dim + j];
+            d += diff * diff;
+        }
+        return d;
+    }
+
+    template <typename Iter>
+    void train_centroid(Iter begin, size_t n, uint64_t seed);
+
+    std::vector<std::shared_ptr<index>> list_shard;
+};
+
+template <typename U, template <typename> class Allocator>
+template <typename Iter>
+HNSW_sharded<U, Allocator>::HNSW_sharded(Iter begin, Iter end, uint32_t dim_,
+        uint32_t cnt_shard_, shard_mode mode_,
+        float m_l, uint32_t m,
+        uint32_t ef_construction, float alpha,
+        float batch_base, const build_control &ctrl)
+    : dim(dim_), cnt_shard(cnt_shard_), mode(mode_), list_shard(cnt_shard_) {
+    const size_t n = std::distance(begin, end);
+    if (cnt_shard == 0 || n < cnt_shard)
+        throw std::invalid_argument("Every shard needs at least one point");
+    if (mode == shard_mode::KMEANS) train_centroid(begin, n, ctrl.seed.value_or(0));
+
+    auto group = parlay::group_by_index(
+                     parlay::delayed_seq<std::pair<uint32_t, T>>(n, [&](size_t i) {
+        const T &p = *(begin + i);
+        return std::pair<uint32_t, T>(route(p), p);
+    }), cnt_shard);
+
+    // each shard is built with all the workers that the others leave idle
+    parlay::parallel_for(0, cnt_shard, [&](uint32_t i) {
+        if (group[i].empty()) {
+            spdlog::warn("Shard {} has no point", i);
+            return;
+        }
+        list_shard[i] = std::make_shared<index>(group[i].begin(), group[i].end(), dim,
+                                                m_l, m, ef_construction, alpha,
+                                                batch_base, ctrl);
+    }, 1);
+    spdlog::info("Built {} shards: sizes {} to {}", cnt_shard,
+                 parlay::reduce(parlay::map(group, [](const auto &g) {
+                     return g.size();
+                 }), parlay::minm<size_t>()),
+                 parlay::reduce(parlay::map(group, [](const auto &g) {
+                     return g.size();
+                 }), parlay::maxm<size_t>()));
+}
+
+template <typename U, template <typename> class Allocator>
+template <typename Iter>
+void HNSW_sharded<U, Allocator>::train_centroid(Iter begin, size_t n, uint64_t seed) {
+    // Lloyd's iterations on a sample, seeded with distinct sampled points
+    const size_t size_sample = std::min<size_t>(n, size_t(cnt_shard) * 256);
+    auto sample = parlay::random_permutation(n, parlay::random_generator(seed))
+                  .head(size_sample);
+    centroid = parlay::sequence<float>(size_t(cnt_shard) * dim);
+    parlay::parallel_for(0, cnt_shard, [&](uint32_t c) {
+        const T &p = *(begin + sample[c]);
+        for (uint32_t j = 0; j < dim; ++j) centroid[size_t(c) * dim + j] = p.coord[j];
+    });
+
+    const uint32_t cnt_round = 10;
+    for (uint32_t r = 0; r < cnt_round; ++r) {
+        auto assign = parlay::map(sample, [&](size_t i) {
+            return route(*(begin + i));
+        });
+        parlay::sequence<float> sum(size_t(cnt_shard) * dim, 0);
+        parlay::sequence<size_t> cnt(cnt_shard, 0);
+        for (size_t s = 0; s < size_sample; ++s) {
+            const T &p = *(begin + sample[s]);
+            cnt[assign[s]]++;
+            for (uint32_t j = 0; j < dim; ++j) sum[size_t(assign[s]) * dim + j] += p.coord[j];
+        }
+        // an emptied cluster keeps its centroid
+        parlay::parallel_for(0, cnt_shard, [&](uint32_t c) {
+            if (cnt[c] == 0) return;
+            for (uint32_t j = 0; j < dim; ++j)
+                centroid[size_t(c) * dim + j] = sum[size_t(c) * dim + j] / cnt[c];
+        });
+    }
+}
+
+template <typename U, template <typename> class Allocator>
+uint32_t HNSW_sharded<U, Allocator>::route(const T &p) const {
+    if (mode != shard_mode::KMEANS) return parlay::hash64(U::get_id(p)) % cnt_shard;
+    uint32_t best = 0;
+    float d_best = std::numeric_limits<float>::max();
+    for (uint32_t c = 0; c < cnt_shard; ++c) {
+        const float d = dist_centroid(p, c);
+        if (d < d_best) d_best = d, best = c;
+    }
+    return best;
+}
+
+template <typename U, template <typename> class Allocator>
+auto HNSW_sharded<U, Allocator>::search(const T &q, uint32_t k, uint32_t ef,
+        const search_control &ctrl, uint32_t cnt_probe) const
+-> parlay::sequence<std::pair<node_id, float>> {
+    parlay::sequence<uint32_t> probe;
+    if (mode == shard_mode::KMEANS && cnt_probe && cnt_probe < cnt_shard) {
+        auto order = parlay::tabulate(cnt_shard, [&](uint32_t c) {
+            return std::pair<float, uint32_t>(dist_centroid(q, c), c);
+        });
+        std::partial_sort(order.begin(), order.begin() + cnt_probe, order.end());
+        probe = parlay::tabulate(cnt_probe, [&](uint32_t i) {
+            return order[i].second;
+        });
+    } else {
+        probe = parlay::iota<uint32_t>(cnt_shard);
+    }
+
+    // a truncated search on any shard makes the merged one truncated
+    std::vector<char> truncated(probe.size(), false);
+    auto part = parlay::tabulate(probe.size(), [&](size_t i) {
+        const auto shard = get_shard(probe[i]);
+        if (!shard) return parlay::sequence<std::pair<node_id, float>>();
+        bool t = false;
+        search_control c = ctrl;
+        if (ctrl.truncated) c.truncated = &t;
+        auto res = shard->search(q, k, ef, c);
+        truncated[i] = t;
+        return res;
+    }, 1);
+    if (ctrl.truncated)
+        **ctrl.truncated = std::find(truncated.begin(), truncated.end(), true) !=
+                           truncated.end();
+
+    auto res = parlay::flatten(part);
+    auto by_dist = [](const auto &a, const auto &b) {
+        return a.second < b.second || (a.second == b.second && a.first < b.first);
+    };
+    if (res.size() > k) {
+        std::partial_sort(res.begin(), res.begin() + k, res.end(), by_dist);
+        res.resize(k);
+    } else {
+        std::sort(res.begin(), res.end(), by_dist);
+    }
+    return res;
+}
+
+template <typename U, template <typename> class Allocator>
+void HNSW_sharded<U, Allocator>::save(const std::string &filename_manifest,
+                                      uint32_t version, type_payload payload) const {
+    // magic, version, dim, cnt_shard, mode, then the centroids if any
+    parlay::sequence<char> buf(sizeof(magic_manifest) + 4 * sizeof(uint32_t) +
+                               centroid.size() * sizeof(float));
+    char *p = buf.data();
+    auto write = [&](const void *data, size_t size) {
+        memcpy(p, data, size);
+        p += size;
+    };
+    const uint32_t field[4] = {1, dim, cnt_shard, uint32_t(mode)};
+    write(magic_manifest, sizeof(magic_manifest));
+    write(field, sizeof(field));
+    write(centroid.data(), centroid.size() * sizeof(float));
+
+    const int fd = open(filename_manifest.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) throw std::runtime_error("Failed to create the manifest");
+    index::write_parallel(fd, buf.data(), buf.size(), 0);
+    close(fd);
+
+    for (uint32_t i = 0; i < cnt_shard; ++i) {
+        if (get_shard(i)) save_shard(i, filename_manifest, version, payload);
+    }
+}
+
+template <typename U, template <typename> class Allocator>
+template <typename G>
+HNSW_sharded<U, Allocator>::HNSW_sharded(const std::string &filename_manifest,
+        G getter) {
+    const int fd = open(filename_manifest.c_str(), O_RDONLY);
+    if (fd == -1) throw std::runtime_error("Failed to open the manifest");
+    std::unique_ptr<int, void (*)(int *)> guard_fd(new int(fd), [](int *fd) {
+        close(*fd);
+        delete fd;
+    });
+    char magic[sizeof(magic_manifest)];
+    uint32_t field[4];
+    struct stat sb;
+    if (fstat(fd, &sb) == -1 || size_t(sb.st_size) < sizeof(magic) + sizeof(field))
+        throw std::runtime_error("Truncated manifest");
+    index::read_parallel(fd, magic, sizeof(magic), 0);
+    index::read_parallel(fd, (char *)field, sizeof(field), sizeof(magic));
+    if (memcmp(magic, magic_manifest, sizeof(magic)) || field[0] != 1 || field[2] == 0 ||
+            (field[3] != uint32_t(shard_mode::RANDOM) && field[3] != uint32_t(shard_mode::KMEANS)))
+        throw std::runtime_error("Wrong type of manifest");
+    dim = field[1];
+    cnt_shard = field[2];
+    mode = shard_mode(field[3]);
+    if (mode == shard_mode::KMEANS) {
+        centroid = parlay::sequence<float>(size_t(cnt_shard) * dim);
+        if (size_t(sb.st_size) < sizeof(magic) + sizeof(field) + centroid.size() * sizeof(float))
+            throw std::runtime_error("Truncated manifest");
+        index::read_parallel(fd, (char *)centroid.data(), centroid.size() * sizeof(float),
+                             sizeof(magic) + sizeof(field));
+    }
+
+    list_shard.resize(cnt_shard);
+    parlay::parallel_for(0, cnt_shard, [&](uint32_t i) {
+        const auto filename = filename_shard(filename_manifest, i);
+        if (access(filename.c_str(), F_OK) == 0)
+            list_shard[i] = std::make_shared<index>(filename, getter);
+        else
+            spdlog::warn("Shard {} is missing", i);
+    }, 1);
+}
+
+}  // namespace ANN
+
+#endif  // _HNSW_SHARDED_HPP
@@ -0,0 +1,405 @@
+#ifndef _HNSW_STREAM_BUILD_HPP
+#define _HNSW_STREAM_BUILD_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "HNSW.hpp"
+
+namespace ANN {
+
+// The same distance descriptor over another element type
+template <class U, typename E>
+struct rebind_descr;
+
+template <template <typename, typename> class D, typename T, typename Id, typename E>
+struct rebind_descr<D<T, Id>, E> {
+    using type = D<E, Id>;
+};
+
+// Reads the rows of a fvecs or bin file front to back in chunks, so that the
+// file never has to fit in memory
+template <typename Src>
+class stream_reader {
+public:
+    using type = Src;
+
+    stream_reader(const std::string &filename, file_format format,
+                  size_t max_num = 0)
+        : format(format) {
+        if (format != file_format::VEC && format != file_format::BIN)
+            throw std::invalid_argument("Only fvecs and bin inputs can be streamed");
+        fd = open(filename.c_str(), O_RDONLY);
+        if (fd == -1) throw std::runtime_error("Failed to open " + filename);
+
+        try {
+            if (format == file_format::BIN) {
+                uint32_t header[2];
+                read_full(header, sizeof(header), 0);
+                n = header[0];
+                dim = header[1];
+                off_data = sizeof(header);
+                size_row = sizeof(Src) * dim;
+            } else {
+                // every row carries its dimension as a prefix
+                struct stat sb;
+                if (fstat(fd, &sb) == -1)
+                    throw std::runtime_error("Failed to stat " + filename);
+                read_full(&dim, sizeof(dim), 0);
+                off_data = 0;
+                size_row = sizeof(uint32_t) + sizeof(Src) * dim;
+                n = sb.st_size / size_row;
+            }
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        if (max_num) n = std::min(n, max_num);
+    }
+
+    stream_reader(const stream_reader &) = delete;
+    stream_reader &operator=(const stream_reader &) = delete;
+
+    ~stream_reader() {
+        close(fd);
+    }
+
+    uint32_t get_dim() const {
+        return dim;
+    }
+
+    size_t size() const {
+        return n;
+    }
+
+    // Read the next (at most) `cnt` rows densely into `buf`; returns how many
+    size_t read(Src *buf, size_t cnt) {
+        cnt = std::min(cnt, n - pos);
+        if (format == file_format::BIN)
+            read_full(buf, cnt * size_row, off_data + pos * size_row);
+        else {
+            staging.resize(cnt * size_row);
+            read_full(staging.data(), cnt * size_row, off_data + pos * size_row);
+            parlay::parallel_for(0, cnt, [&](size_t i) {
+                std::memcpy(buf + i * dim, &staging[i * size_row + sizeof(uint32_t)],
+                            sizeof(Src) * dim);
+            });
+        }
+        pos += cnt;
+        return cnt;
+    }
+
+private:
+    void read_full(void *buf, size_t size, size_t off) {
+        for (char *p = (char *)buf; size > 0;) {
+            const ssize_t cnt = pread(fd, p, size, off);
+            if (cnt == -1 && errno == EINTR) continue;
+            if (cnt <= 0) throw std::runtime_error("Failed to read the input rows");
+            p += cnt;
+            size -= cnt;
+            off += cnt;
+        }
+    }
+
+    file_format format;
+    int fd;
+    uint32_t dim;
+    size_t n, pos = 0;
+    size_t off_data, size_row;
+    std::vector<char> staging;
+};
+
+// Builds an index from an input larger than the memory. The rows are streamed
+// in chunks of `build_control::stream_chunk` and inserted as 8-bit codes,
+// while the rows themselves are spilled to a bin file. The codes are symmetric
+// with one scale for all the dimensions (taken from the first chunk), so L2,
+// inner product and angle keep their order up to the rounding. The graph is
+// built with `stream_slack` times the degree and the lists are finally pruned
+// to the degree with the exact distances read back from the spill file
+template <typename U, template <typename> class Allocator = std::allocator>
+class HNSW_stream {
+    using T = typename U::type_point;
+    using type_elem = typename U::type_elem;
+    typedef typename id_of<U>::type node_id;
+    static_assert(std::is_constructible_v<T, node_id, const type_elem *>);
+
+    // the integers are not smaller as codes and are kept as they are
+    static constexpr bool quantized = std::is_floating_point_v<type_elem>;
+    using type_code = std::conditional_t<quantized, int8_t, type_elem>;
+    static constexpr size_t size_header = 2 * sizeof(uint32_t);
+
+public:
+    using descr_code = typename rebind_descr<U, type_code>::type;
+    using index = HNSW<descr_code, Allocator>;
+
+    template <class Reader>
+    HNSW_stream(Reader &reader, const std::string &filename_spill, float m_l = 16,
+                uint32_t m = 16, uint32_t ef_construction = 50, float alpha = 5,
+                float batch_base = 2, const build_control &ctrl = {});
+
+    HNSW_stream(const HNSW_stream &) = delete;
+    HNSW_stream &operator=(const HNSW_stream &) = delete;
+
+    // Search on the codes and rerank the `ef` nearest by the exact distances
+    parlay::sequence<std::pair<node_id, float>> search(
+                const T &q, uint32_t k, uint32_t ef, const search_control &ctrl = {});
+
+    // The graph is an ordinary model whose ids are the row numbers, and the
+    // spill file is a bin file of the rows that it can be loaded with
+    void save(const std::string &filename_model) const {
+        graph.save(filename_model);
+    }
+
+    const type_elem *get_row(node_id pu) const {
+        return (const type_elem *)((const char *)spill.get() + size_header) +
+               size_t(pu) * dim;
+    }
+
+    uint32_t dim;
+    size_t n;
+    float scale = 1;  // of the codes
+
+private:
+    template <class Reader>
+    index build_first(Reader &reader, const std::string &filename_spill, float m_l,
+                      uint32_t m, uint32_t ef_construction, float alpha,
+                      float batch_base, const build_control &ctrl);
+
+    // spill the rows of [begin, begin+cnt) and encode them; returns the points
+    template <typename Src>
+    parlay::sequence<typename descr_code::type_point> ingest(const Src *rows, size_t begin,
+                                              size_t cnt);
+
+    void encode(const type_elem *v, type_code *c) const;
+    void prune_exact();
+
+    parlay::sequence<type_code> code;
+    // open while the rows are spilled, and closed if the build throws
+    std::unique_ptr<int, void (*)(int *)> fd_spill{nullptr, [](int *fd) {
+        close(*fd);
+        delete fd;
+    }};
+    std::shared_ptr<void> spill;  // mapping of the spill file once written
+
+public:
+    index graph;
+};
+
+template <typename U, template <typename> class Allocator>
+template <class Reader>
+HNSW_stream<U, Allocator>::HNSW_stream(Reader &reader,
+                                       const std::string &filename_spill,
+                                       float m_l, uint32_t m,
+                                       uint32_t ef_construction, float alpha,
+                                       float batch_base, const build_control &ctrl)
+    : dim(reader.get_dim()),
+      n(reader.size()),
+      code(parlay::sequence<type_code>::uninitialized(n * dim)),
+      graph(build_first(reader, filename_spill, m_l,
+                        uint32_t(std::ceil(m * ctrl.stream_slack)),
+                        ef_construction, alpha, batch_base, ctrl)) {
+    using Src = typename Reader::type;
+    const size_t size_chunk = std::max<size_t>(ctrl.stream_chunk, 1);
+    const uint32_t size_limit =
+        std::max(ctrl.batch_limit.value_or(n * 0.02), 1u);
+
+    // the next chunk is read while the current one is inserted
+    auto buf = parlay::sequence<Src>::uninitialized(size_chunk * dim);
+    auto buf_next = parlay::sequence<Src>::uninitialized(size_chunk * dim);
+    size_t begin = graph.n;
+    size_t cnt = reader.read(buf.data(), size_chunk);
+    while (cnt > 0) {
+        auto ps = ingest(buf.data(), begin, cnt);
+        size_t cnt_next = 0;
+        parlay::par_do([&] {
+            cnt_next = reader.read(buf_next.data(), size_chunk);
+        }, [&] {
+            size_t batch_begin = 0;
+            while (batch_begin < cnt) {
+                const size_t size_graph = begin + batch_begin;
+                const size_t batch_end = std::min({cnt,
+                                                   batch_begin + size_t(std::ceil(size_graph * (batch_base - 1))) + 1,
+                                                   batch_begin + size_limit});
+                graph.insert(ps.begin() + batch_begin, ps.begin() + batch_end, true);
+                batch_begin = batch_end;
+            }
+        });
+        begin += cnt;
+        cnt = cnt_next;
+        std::swap(buf, buf_next);
+        spdlog::info("Streamed: {}/{}", begin, n);
+    }
+    if (begin != n) throw std::runtime_error("The input ended early");
+
+    fd_spill.reset();
+    const int fd = open(filename_spill.c_str(), O_RDONLY);
+    const size_t size_spill = size_header + sizeof(type_elem) * n * dim;
+    void *map = fd == -1 ? MAP_FAILED
+                : mmap(nullptr, size_spill, PROT_READ, MAP_SHARED, fd, 0);
+    if (fd != -1) close(fd);
+    if (map == MAP_FAILED) throw std::runtime_error("Failed to map the spill file");
+    spill = std::shared_ptr<void>(map, [size_spill](void *p) {
+        munmap(p, size_spill);
+    });
+
+    graph.m = m;
+    prune_exact();
+    spdlog::info("Index built from the stream");
+}
+
+template <typename U, template <typename> class Allocator>
+template <class Reader>
+auto HNSW_stream<U, Allocator>::build_first(
+    Reader &reader, const std::string &filename_spill, float m_l, uint32_t m,
+    uint32_t ef_construction, float alpha, float batch_base,
+    const build_control &ctrl) -> index {
+    // the spill file is a bin file, whose count has 32 bits
+    if (n == 0 || n > std::numeric_limits<uint32_t>::max())
+        throw std::runtime_error("Unsupported number of rows to stream");
+    const int fd = open(filename_spill.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) throw std::runtime_error("Failed to create the spill file");
+    fd_spill.reset(new int(fd));
+    const uint32_t header[2] = {uint32_t(n), dim};
+    if (ftruncate(fd, size_header + sizeof(type_elem) * n * dim) != 0 ||
+            pwrite(fd, header, sizeof(header), 0) != sizeof(header))
+        throw std::runtime_error("Failed to write the spill file");
+
+    const size_t size_chunk = std::max<size_t>(ctrl.stream_chunk, 1);
+    auto buf = parlay::sequence<typename Reader::type>::uninitialized(size_chunk * dim);
+    const size_t cnt = reader.read(buf.data(), size_chunk);
+
+    if constexpr (quantized) {
+        const float max_abs = parlay::reduce(
+                                  parlay::delayed_seq<float>(cnt * dim, [&](size_t i) {
+                                      return std::abs(float(buf[i]));
+                                  }),
+                                  parlay::maxm<float>());
+        // the later rows are clamped if they go beyond the first chunk
+        scale = max_abs > 0 ? max_abs / 127 : 1;
+    }
+
+    auto ps = ingest(buf.data(), 0, cnt);
+    build_control ctrl_first = ctrl;
+    // batches as if the whole input were inserted at once
+    ctrl_first.batch_limit = std::max(ctrl.batch_limit.value_or(n * 0.02), 1u);
+    return index(ps.begin(), ps.end(), dim, m_l, m, ef_construction, alpha,
+                 batch_base, ctrl_first);
+}
+
+template <typename U, template <typename> class Allocator>
+template <typename Src>
+auto HNSW_stream<U, Allocator>::ingest(const Src *rows, size_t begin, size_t cnt)
+-> parlay::sequence<typename descr_code::type_point> {
+    const type_elem *v;
+    parlay::sequence<type_elem> converted;
+    if constexpr (std::is_same_v<Src, type_elem>)
+        v = rows;
+    else {
+        converted = parlay::tabulate(cnt * dim, [&](size_t i) {
+            return type_elem(rows[i]);
+        });
+        v = converted.data();
+    }
+
+    const size_t size_row = sizeof(type_elem) * dim;
+    std::atomic<bool> failed = false;
+    const size_t rows_per_write = std::max<size_t>((16ul << 20) / size_row, 1);
+    parlay::par_do([&] {
+        parlay::parallel_for(0, (cnt + rows_per_write - 1) / rows_per_write, [&](size_t c) {
+            const size_t first = c * rows_per_write;
+            const size_t last = std::min(first + rows_per_write, cnt);
+            const char *p = (const char *)(v + first * dim);
+            size_t size = (last - first) * size_row;
+            size_t off = size_header + (begin + first) * size_row;
+            while (size > 0 && !failed) {
+                const ssize_t res = pwrite(*fd_spill, p, size, off);
+                if (res == -1 && errno == EINTR) continue;
+                if (res <= 0) failed = true;
+                else p += res, size -= res, off += res;
+            }
+        }, 1);
+    }, [&] {
+        parlay::parallel_for(0, cnt, [&](size_t i) {
+            encode(v + i * dim, &code[(begin + i) * dim]);
+        });
+    });
+    if (failed) throw std::runtime_error("Failed to write the spill file");
+
+    return parlay::tabulate(cnt, [&](size_t i) {
+        return typename descr_code::type_point(begin + i, &code[(begin + i) * dim]);
+    });
+}
+
+template <typename U, template <typename> class Allocator>
+void HNSW_stream<U, Allocator>::encode(const type_elem *v, type_code *c) const {
+    for (uint32_t j = 0; j < dim; ++j) {
+        if constexpr (quantized)
+            c[j] = int8_t(std::clamp(std::round(v[j] / scale), -127.f, 127.f));
+        else
+            c[j] = v[j];
+    }
+}
+
+template <typename U, template <typename> class Allocator>
+void HNSW_stream<U, Allocator>::prune_exact() {
+    // the graph as seen by the pruning, with the rows in place of the codes
+    struct rows_graph {
+        const HNSW_stream &s;
+        struct node {
+            T data;
+        };
+        node get_node(node_id pu) const {
+            return {T(pu, s.get_row(pu))};
+        }
+    } g{*this};
+    auto f_dist = [&](const T &u, const T &v) {
+        return U::distance(u, v, dim);
+    };
+
+    for (uint32_t l = 0; l <= graph.get_height(); ++l) {
+        parlay::parallel_for(0, graph.n, [&](node_id pu) {
+            auto &u = graph.get_node(pu);
+            if (u.level < l) return;
+            const auto nbh = index::neighbourhood(u, l).view();
+            const T data_u = g.get_node(pu).data;
+            parlay::sequence<typename index::dist> cand(nbh.size());
+            for (size_t i = 0; i < nbh.size(); ++i)
+                cand[i] = {f_dist(data_u, g.get_node(nbh[i]).data), nbh[i]};
+            const auto res = graph.prune_heuristic(std::move(cand),
+                                                   graph.get_threshold_m(l), f_dist, g);
+            index::neighbourhood(u, l) = parlay::delayed_seq<node_id>(res.size(), [&](size_t i) {
+                return res[i].u;
+            });
+        });
+    }
+    epoch_domain::global().reclaim();
+}
+
+template <typename U, template <typename> class Allocator>
+auto HNSW_stream<U, Allocator>::search(const T &q, uint32_t k, uint32_t ef,
+                                       const search_control &ctrl)
+-> parlay::sequence<std::pair<node_id, float>> {
+    auto q_code = parlay::sequence<type_code>::uninitialized(dim);
+    encode(q.coord, q_code.data());
+    auto res = graph.search(typename descr_code::type_point(q.id, q_code.data()),
+                            std::max(k, ef), ef, ctrl);
+    for (auto &[id, d] : res) d = U::distance(q, T(id, get_row(id)), dim);
+    std::sort(res.begin(), res.end(), [](const auto &a, const auto &b) {
+        return a.second < b.second || (a.second == b.second && a.first < b.first);
+    });
+    if (res.size() > k) res.resize(k);
+    return res;
+}
+
+}  // namespace ANN
+
+#endif  // _HNSW_STREAM_BUILD_HPP
@@ -5,12 +5,15 @@
 #include <any>
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
 #include <iterator>
 #include <memory>
+#include <new>
 #include <stdexcept>
 #include <type_traits>
 
 #include "../bench/benchUtils.h"
+#include "huge_page.hpp"
 
 #ifdef SUPPORT_HDF5
 #include "h5_ops.hpp"
@@ -49,17 +52,19 @@ fake_copyable(const T &) -> fake_copyable<T>;
 template <typename T>
 fake_copyable(T &&) -> fake_copyable<T>;
 
-template <typename T>
+// Id is 32 bits unless an index is to hold more than 4G points
+template <typename T, typename Id = uint32_t>
 struct point {
     typedef T type;
+    typedef Id type_id;
 
-    uint32_t id;
+    Id id;
     const T *coord;
 
-    point() : id(~0u), coord(NULL), closure() {}
-    point(uint32_t id_, const T *coord_) : id(id_), coord(coord_), closure() {}
+    point() : id(~Id(0)), coord(NULL), closure() {}
+    point(Id id_, const T *coord_) : id(id_), coord(coord_), closure() {}
     template <class C>
-    point(uint32_t id_, const T *coord_, C &&closure_)
+    point(Id id_, const T *coord_, C &&closure_)
         : id(id_), coord(coord_), closure(std::forward<C>(closure_)) {}
 
 private:
@@ -68,13 +73,13 @@ private:
 
 enum class file_format { VEC, HDF5, BIN };
 
-template <typename T>
+template <typename T, typename Id = uint32_t>
 class point_converter_default {
 public:
-    using type = point<T>;
+    using type = point<T, Id>;
 
     template <typename Iter>
-    type operator()(uint32_t id, Iter begin, [[maybe_unused]] Iter end) {
+    type operator()(Id id, Iter begin, [[maybe_unused]] Iter end) {
         using type_src = typename std::iterator_traits<Iter>::value_type;
         static_assert(std::is_convertible_v<type_src, T>,
                       "Cannot convert to the target type");
@@ -83,26 +88,105 @@ public:
                       ptr_mapped<T, ptr_mapped_src::PERSISTENT>> ||
                       std::is_same_v<
                       Iter, ptr_mapped<const T, ptr_mapped_src::PERSISTENT>>)
-            return point<T>(id, &*begin);
+            return type(id, &*begin);
         else if constexpr (
             std::is_same_v<Iter, ptr_mapped<T, ptr_mapped_src::TRANSITIVE>> ||
             std::is_same_v<Iter, ptr_mapped<const T, ptr_mapped_src::TRANSITIVE>>) {
             const T *p = &*begin;  // TODO: fix the type to T(*)[]
-            return point<T>(id, p, fake_copyable(std::unique_ptr<const T>(p)));
+            return type(id, p, fake_copyable(std::unique_ptr<const T>(p)));
         } else {
             const uint32_t dim = std::distance(begin, end);
 
             // T *coord = new T[dim];
-            auto coord = std::make_unique<T[]>(dim);
+            std::unique_ptr<T[], ANN::huge_page_deleter> coord(
+                static_cast<T *>(ANN::huge_page_pool::global().allocate(dim * sizeof(T))));
             for (uint32_t i = 0; i < dim; ++i) coord[i] = *(begin + i);
-            return point<T>(id, coord.get(), fake_copyable(std::move(coord)));
+            // the arguments may be evaluated in any order
+            const T *p = coord.get();
+            return type(id, p, fake_copyable(std::move(coord)));
         }
     }
+
+    // A row of a buffer held by `owner`, which the point shares through its
+    // closure rather than copying the row
+    template <typename Iter>
+    type operator()(Id id, Iter begin, Iter end, std::shared_ptr<const void> owner) {
+        if constexpr (std::is_same_v<Iter, ptr_mapped<T, ptr_mapped_src::PERSISTENT>> ||
+                      std::is_same_v<Iter, ptr_mapped<const T, ptr_mapped_src::PERSISTENT>>)
+            return type(id, &*begin, std::move(owner));
+        else
+            return (*this)(id, begin, end);
+    }
+};
+
+template <class, class = void>
+class trait_type {};
+
+template <class T>
+class trait_type<T, std::void_t<typename T::type>> {
+public:
+    using type = typename T::type;
+};
+
+template <class T>
+class trait_type<T *, void> {
+public:
+    using type = T;
 };
 
+template <class T>
+class trait_type<parlay::sequence<T>, void> {
+public:
+    using type = T;
+};
+
+// whether the converter can make points that share the buffer of their rows
+template <typename Src, class Conv>
+inline constexpr bool shares_rows_v = std::is_invocable_v<
+        Conv &, size_t, ptr_mapped<const Src, ptr_mapped_src::PERSISTENT>,
+        ptr_mapped<const Src, ptr_mapped_src::PERSISTENT>, std::shared_ptr<const void>>;
+
+// With huge pages, the rows of a mapped file are copied to index memory, as
+// the page cache behind the mapping has no huge pages, and the points share
+// the copy. Returns the rows packed, or null if they are served from the
+// mapping (also when the converter copies them anyway)
+template <typename Src, class Conv>
+inline std::shared_ptr<const Src> pack_rows(const char *src, size_t n, size_t stride,
+        uint32_t dim) {
+    if constexpr (!std::is_same_v<typename trait_type<typename Conv::type>::type, Src> ||
+                  !shares_rows_v<Src, Conv>) {
+        return nullptr;
+    } else {
+        auto &pool = ANN::huge_page_pool::global();
+        if (pool.mode() == ANN::huge_page_mode::NONE || n == 0) return nullptr;
+        const size_t size_row = sizeof(Src) * dim;
+        std::shared_ptr<Src> buffer(static_cast<Src *>(pool.allocate(n * size_row)),
+                                    ANN::huge_page_deleter());
+        char *p = reinterpret_cast<char *>(buffer.get());
+        parlay::parallel_for(0, n, [&](size_t i) {
+            memcpy(p + i * size_row, src + i * stride, size_row);
+        });
+        return buffer;
+    }
+}
+
+// Convert the row at `coord`, which `packed` holds unless it is null
+template <typename Src, class Conv>
+inline typename Conv::type convert_row(Conv &converter, size_t i, const Src *coord,
+                                       uint32_t dim,
+                                       const std::shared_ptr<const Src> &packed) {
+    typedef ptr_mapped<const Src, ptr_mapped_src::PERSISTENT> type_ptr;
+    if constexpr (shares_rows_v<Src, Conv>) {
+        if (packed)
+            return converter(i, type_ptr(coord), type_ptr(coord + dim),
+                             std::shared_ptr<const void>(packed));
+    }
+    return converter(i, type_ptr(coord), type_ptr(coord + dim));
+}
+
 template <typename Src, class Conv>
 inline std::pair<parlay::sequence<typename Conv::type>, uint32_t> load_from_vec(
-    const char *file, Conv converter, uint32_t max_num) {
+    const char *file, Conv converter, size_t max_num) {
     const auto [fileptr, length] = mmapStringFromFile(file);
 
     // Each vector is 4 + sizeof(Src)*dim bytes.
@@ -114,45 +198,26 @@ inline std::pair<parlay::sequence<typename Conv::type>, uint32_t> load_from_vec(
     std::cout << "Dimension = " << dim << std::endl;
 
     const size_t vector_size = sizeof(dim) + sizeof(Src) * dim;
-    const uint32_t n = std::min<size_t>(length / vector_size, max_num);
+    const size_t n = std::min<size_t>(length / vector_size, max_num);
     // std::cout << "Num vectors = " << n << std::endl;
 
-    typedef ptr_mapped<const Src, ptr_mapped_src::PERSISTENT> type_ptr;
     parlay::sequence<typename Conv::type> ps(n);
+    const auto packed =
+        pack_rows<Src, Conv>(fileptr + sizeof(dim), n, vector_size, dim);
 
     parlay::parallel_for(0, n, [&, fp = fileptr](size_t i) {
-        const Src *coord = (const Src *)(fp + sizeof(dim) + i * vector_size);
-        ps[i] = converter(i, type_ptr(coord), type_ptr(coord + dim));
+        const Src *coord = packed ? packed.get() + i * dim
+                           : (const Src *)(fp + sizeof(dim) + i * vector_size);
+        ps[i] = convert_row(converter, i, coord, dim, packed);
     });
 
     return {std::move(ps), dim};
 }
 
-template <class, class = void>
-class trait_type {};
-
-template <class T>
-class trait_type<T, std::void_t<typename T::type>> {
-public:
-    using type = typename T::type;
-};
-
-template <class T>
-class trait_type<T *, void> {
-public:
-    using type = T;
-};
-
-template <class T>
-class trait_type<parlay::sequence<T>, void> {
-public:
-    using type = T;
-};
-
 template <class Conv>
 inline std::pair<parlay::sequence<typename Conv::type>, uint32_t>
 load_from_HDF5(const char *file, const char *dir, Conv converter,
-               uint32_t max_num) {
+               size_t max_num) {
 #ifndef SUPPORT_HDF5
     (void)file;
     (void)dir;
@@ -165,33 +230,64 @@ load_from_HDF5(const char *file, const char *dir, Conv converter,
     const size_t n = std::min<size_t>(bound[0], max_num);
     const uint32_t dim = bound[1];
 
+    // All the points share one aligned buffer and hold it through their
+    // closures. A converter that takes no owner gets the rows as volatile and
+    // copies them, and the buffer goes with the loader
+    const size_t size_buffer = (n * dim * sizeof(T) + 63) / 64 * 64;
+    std::shared_ptr<T> buffer(
+        static_cast<T *>(ANN::huge_page_pool::global().allocate(
+                             std::max<size_t>(size_buffer, 64))),
+        ANN::huge_page_pool::deallocate);
+
+    // Read large hyperslabs one after another (the HDF5 library is not
+    // thread-safe), while the points of the previous chunk are converted in
+    // parallel
+    const size_t size_chunk =
+        std::max<size_t>((64u << 20) / (std::max(dim, 1u) * sizeof(T)), 1);
+    typedef ptr_mapped<const T, ptr_mapped_src::PERSISTENT> type_ptr;
+    typedef ptr_mapped<const T, ptr_mapped_src::VOLATILE> type_ptr_volatile;
+    constexpr bool shared = shares_rows_v<T, Conv>;
     parlay::sequence<typename Conv::type> ps(n);
-    // TODO: parallel for-loop
-    for (uint32_t i = 0; i < n; ++i) {
-        T *coord = new T[dim];
-        reader(coord, i);
-        typedef ptr_mapped<T, ptr_mapped_src::TRANSITIVE> type_ptr;
-        ps[i] = converter(i, type_ptr(coord), type_ptr(coord + dim));
+    auto convert = [&](size_t begin, size_t end) {
+        parlay::parallel_for(begin, end, [&](size_t i) {
+            const T *coord = buffer.get() + i * dim;
+            if constexpr (shared)
+                ps[i] = converter(i, type_ptr(coord), type_ptr(coord + dim),
+                                  std::shared_ptr<const void>(buffer));
+            else
+                ps[i] = converter(i, type_ptr_volatile(coord),
+                                  type_ptr_volatile(coord + dim));
+        });
+    };
+    size_t begin_prev = 0;
+    for (size_t begin = 0; begin < n; begin += size_chunk) {
+        const size_t end = std::min(begin + size_chunk, n);
+        parlay::par_do([&] { reader(buffer.get() + begin * dim, begin, end - begin); },
+                       [&] { convert(begin_prev, begin); });
+        begin_prev = begin;
     }
+    convert(begin_prev, n);
     return {std::move(ps), dim};
 #endif
 }
 
 template <typename Src, class Conv>
 inline std::pair<parlay::sequence<typename Conv::type>, uint32_t> load_from_bin(
-    const char *file, Conv converter, uint32_t max_num) {
+    const char *file, Conv converter, size_t max_num) {
     auto [fileptr, length] = mmapStringFromFile(file);
     (void)length;
-    const uint32_t n = std::min(max_num, *((uint32_t *)fileptr));
+    const uint32_t n = std::min<size_t>(max_num, *((uint32_t *)fileptr));
     const uint32_t dim = *((uint32_t *)(fileptr + sizeof(n)));
     const size_t vector_size = sizeof(Src) * dim;
     const size_t header_size = sizeof(n) + sizeof(dim);
 
-    typedef ptr_mapped<const Src, ptr_mapped_src::PERSISTENT> type_ptr;
     parlay::sequence<typename Conv::type> ps(n);
+    const auto packed =
+        pack_rows<Src, Conv>(fileptr + header_size, n, vector_size, dim);
     parlay::parallel_for(0, n, [&, fp = fileptr](uint32_t i) {
-        const Src *coord = (const Src *)(fp + header_size + i * vector_size);
-        ps[i] = converter(i, type_ptr(coord), type_ptr(coord + dim));
+        const Src *coord = packed ? packed.get() + size_t(i) * dim
+                           : (const Src *)(fp + header_size + i * vector_size);
+        ps[i] = convert_row(converter, i, coord, dim, packed);
     });
 
     return {std::move(ps), dim};
@@ -199,7 +295,7 @@ inline std::pair<parlay::sequence<typename Conv::type>, uint32_t> load_from_bin(
 
 template <typename Src, class Conv>
 inline std::pair<parlay::sequence<typename Conv::type>, uint32_t>
-load_from_range(const char *file, Conv converter, uint32_t max_num) {
+load_from_range(const char *file, Conv converter, size_t max_num) {
     auto [fileptr, length] = mmapStringFromFile(file);
     (void)length;
     const int32_t num_points = *(int32_t *)fileptr;
@@ -216,7 +312,7 @@ load_from_range(const char *file, Conv converter, uint32_t max_num) {
     std::cout << "index_size: " << index_size << std::endl;
 
     typedef ptr_mapped<const Src, ptr_mapped_src::PERSISTENT> type_ptr;
-    const uint32_t n = std::min<uint32_t>(max_num, num_points);
+    const uint32_t n = std::min<size_t>(max_num, num_points);
     parlay::sequence<typename Conv::type> ps(n);
     parlay::parallel_for(0, n, [&, fp = fileptr](uint32_t i) {
         const Src *begin =
@@ -166,8 +166,9 @@ struct std::iterator_traits<detail::ptr_mapped_impl<T,Src>>
 // Parsing code (should move to common?)
 // *************************************************************
 
-// returns a pointer and a length
-std::pair<char *, size_t> mmapStringFromFile(const char *filename) {
+// returns a pointer and a length; `flags` are added to the mmap flags,
+// e.g., MAP_POPULATE to prefault the file instead of on first access
+std::pair<char *, size_t> mmapStringFromFile(const char *filename, int flags = 0) {
     struct stat sb;
     int fd = open(filename, O_RDONLY);
     if (fd == -1) {
@@ -183,7 +184,7 @@ std::pair<char *, size_t> mmapStringFromFile(const char *filename) {
         exit(-1);
     }
     char *p =
-        static_cast<char *>(mmap(0, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
+        static_cast<char *>(mmap(0, sb.st_size, PROT_READ, MAP_PRIVATE | flags, fd, 0));
     if (p == MAP_FAILED) {
         perror("mmap");
         exit(-1);
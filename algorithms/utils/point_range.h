@@ -26,6 +26,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <algorithm>
@@ -38,6 +39,12 @@
 
 namespace parlayANN {
 
+// How PointRange reads a .bin file: pread of disjoint ranges from all the
+// workers straight into the padded slots; O_DIRECT reads of aligned blocks
+// that bypass the page cache; or mapping the file without a copy, which is
+// only possible when the rows need no padding (falls back to PREAD otherwise)
+enum class read_mode { PREAD, DIRECT, MMAP };
+
 template <class Point_>
 struct PointRange {
     // using T = T_;
@@ -74,24 +81,24 @@ struct PointRange {
     PointRange(PR& pr, int dims)
         : PointRange(pr, Point::generate_parameters(dims)) {}
 
-    PointRange(char* filename)
+    PointRange(char* filename, read_mode mode = read_mode::PREAD)
         : values(std::shared_ptr<byte[]>(nullptr, std::free)) {
         if (filename == NULL) {
             n = 0;
             return;
         }
-        std::ifstream reader(filename);
-        if (!reader.is_open()) {
+        int fd = open(filename, O_RDONLY);
+        if (fd == -1) {
             std::cout << "Data file " << filename << " not found" << std::endl;
             std::abort();
         }
 
         // read num points and max degree
-        unsigned int num_points;
-        unsigned int d;
-        reader.read((char*)(&num_points), sizeof(unsigned int));
+        unsigned int header[2];
+        read_full(fd, (byte*)header, sizeof(header), 0);
+        unsigned int num_points = header[0];
+        unsigned int d = header[1];
         n = num_points;
-        reader.read((char*)(&d), sizeof(unsigned int));
         params = parameters(d);
         std::cout << "Data: detected " << num_points << " points with dimension "
                   << d << std::endl;
@@ -99,25 +106,47 @@ struct PointRange {
         aligned_bytes = 64 * ((num_bytes - 1) / 64 + 1);
         if (aligned_bytes != num_bytes)
             std::cout << "Aligning bytes to " << aligned_bytes << std::endl;
+        const size_t off_data = sizeof(header);
+
+        if (mode == read_mode::MMAP) {
+            if (aligned_bytes == num_bytes) {
+                // the rows are used in place, 8 bytes past a 64-byte boundary
+                const size_t size_map = off_data + n * num_bytes;
+                byte* map = (byte*)mmap(0, size_map, PROT_READ, MAP_PRIVATE, fd, 0);
+                close(fd);
+                if (map == MAP_FAILED) {
+                    perror("mmap");
+                    std::abort();
+                }
+                madvise(map, size_map, MADV_WILLNEED);
+                values = std::shared_ptr<byte[]>(
+                map + off_data, [map, size_map](byte*) {
+                    munmap(map, size_map);
+                });
+                return;
+            }
+            std::cout << "Rows are padded; reading the file instead of mapping it"
+                      << std::endl;
+            mode = read_mode::PREAD;
+        }
+
         long total_bytes = n * aligned_bytes;
         byte* ptr = (byte*)aligned_alloc(1l << 21, total_bytes);
         madvise(ptr, total_bytes, MADV_HUGEPAGE);
         values = std::shared_ptr<byte[]>(ptr, std::free);
-        size_t BLOCK_SIZE = 1000000;
-        size_t index = 0;
-        while (index < n) {
-            size_t floor = index;
-            size_t ceiling = index + BLOCK_SIZE <= n ? index + BLOCK_SIZE : n;
-            long m = ceiling - floor;
-            byte* data_start = new byte[m * num_bytes];
-            reader.read((char*)(data_start), m * num_bytes);
-            parlay::parallel_for(floor, ceiling, [&](size_t i) {
-                std::memmove(values.get() + i * aligned_bytes,
-                             data_start + (i - floor) * num_bytes, num_bytes);
-            });
-            delete[] data_start;
-            index = ceiling;
+
+        if (mode == read_mode::DIRECT) {
+            const int fd_direct = open(filename, O_RDONLY | O_DIRECT);
+            if (fd_direct != -1) {
+                read_direct(fd_direct, off_data, num_bytes);
+                close(fd_direct);
+                close(fd);
+                return;
+            }
+            std::cout << "O_DIRECT is not supported; using pread" << std::endl;
         }
+        read_rows(fd, off_data, num_bytes);
+        close(fd);
     }
 
     size_t size() const {
@@ -144,6 +173,93 @@ struct PointRange {
     parameters params;
 
 private:
+    static void read_full(int fd, byte* buf, size_t size, size_t off) {
+        while (size > 0) {
+            const ssize_t cnt = pread(fd, buf, size, off);
+            if (cnt == -1 && errno == EINTR) continue;
+            if (cnt <= 0) {
+                perror("pread");
+                std::abort();
+            }
+            buf += cnt;
+            size -= cnt;
+            off += cnt;
+        }
+    }
+
+    // every worker reads its own ranges of rows; padded rows are gathered
+    // into their slots with one preadv per batch of rows
+    void read_rows(int fd, size_t off_data, size_t num_bytes) {
+        const size_t rows_per_chunk = std::max<size_t>((16ul << 20) / num_bytes, 1);
+        const size_t rows_per_call = 1024;  // IOV_MAX on Linux
+        parlay::parallel_for(0, (n + rows_per_chunk - 1) / rows_per_chunk, [&](size_t c) {
+            const size_t begin = c * rows_per_chunk;
+            const size_t end = std::min(begin + rows_per_chunk, n);
+            if (size_t(aligned_bytes) == num_bytes) {
+                read_full(fd, location(begin), (end - begin) * num_bytes,
+                          off_data + begin * num_bytes);
+                return;
+            }
+            iovec iov[rows_per_call];
+            for (size_t i = begin; i < end; i += rows_per_call) {
+                const size_t cnt_row = std::min(rows_per_call, end - i);
+                for (size_t k = 0; k < cnt_row; ++k) iov[k] = {location(i + k), num_bytes};
+                ssize_t cnt = preadv(fd, iov, cnt_row, off_data + i * num_bytes);
+                if (cnt == -1) cnt = 0;
+                // finish a short read row by row
+                for (size_t k = cnt / num_bytes; k < cnt_row; ++k) {
+                    const size_t done = k == size_t(cnt) / num_bytes ? cnt % num_bytes : 0;
+                    read_full(fd, location(i + k) + done, num_bytes - done,
+                              off_data + (i + k) * num_bytes + done);
+                }
+            }
+        }, 1);
+    }
+
+    // aligned blocks of the file are read by every worker into its staging
+    // buffer and copied into the slots of the rows they overlap
+    void read_direct(int fd, size_t off_data, size_t num_bytes) {
+        const size_t size_block = 4ul << 20;
+        const size_t end_data = off_data + n * num_bytes;
+        parlay::parallel_for(0, (end_data + size_block - 1) / size_block, [&](size_t c) {
+            const size_t size_align = 4096;
+            std::unique_ptr<byte, decltype(&std::free)> staging(
+                (byte*)aligned_alloc(size_align, size_block), std::free);
+            if (!staging) {
+                perror("aligned_alloc");
+                std::abort();
+            }
+            const size_t begin = std::max(c * size_block, off_data);
+            const size_t end = std::min((c + 1) * size_block, end_data);
+            size_t got = 0;
+            while (c * size_block + got < end) {
+                const ssize_t cnt = pread(fd, staging.get() + got, size_block - got,
+                                          c * size_block + got);
+                if (cnt == -1 && errno == EINTR) continue;
+                if (cnt <= 0) {
+                    perror("pread");
+                    std::abort();
+                }
+                if (c * size_block + got + cnt >= end) break;
+                // O_DIRECT needs the buffer and the offset aligned, so a short
+                // read resumes from the last whole block it returned
+                const size_t next = (got + cnt) / size_align * size_align;
+                if (next == got) {
+                    std::cout << "ERROR: short read within a block" << std::endl;
+                    std::abort();
+                }
+                got = next;
+            }
+            for (size_t x = begin; x < end;) {
+                const size_t row = (x - off_data) / num_bytes;
+                const size_t col = (x - off_data) % num_bytes;
+                const size_t len = std::min(num_bytes - col, end - x);
+                std::memcpy(location(row) + col, staging.get() + (x - c * size_block), len);
+                x += len;
+            }
+        }, 1);
+    }
+
     std::shared_ptr<byte[]> values;
     long aligned_bytes;
     size_t n;